@@ -13,180 +13,719 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
-
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <err.h>
+#include <time.h>
+#include <unistd.h>
 #include <json.h>
 
 #include "8tracks.h"
 #include "curl.h"
 
 #define SERVERNAME	"https://8tracks.com/"
+#define MIXTTL		300	/* seconds a mix lookup or search is reused */
+#define ALIGN(n)	(((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/*
+ * The records of one response are built in a single block of memory: each
+ * structure is followed by copies of its strings.  A first pass with a NULL
+ * base only measures how large the block has to be, the second pass fills
+ * it.  A response costs one allocation and is freed with one free().
+ */
+struct arena {
+	char	*base;
+	size_t	 pos;
+};
+
+/* the callback of a mix_getbyurls call */
+struct batch {
+	void	(*cb)(size_t, struct mix *, void *);
+	void	*arg;
+};
+
+/* the pages of a mixset_searchpages call */
+struct pages {
+	void	(*cb)(int, struct mix **, size_t, void *);
+	void	*arg;
+	int	 first;
+};
+
+/* what an API call returns */
+enum callkind {
+	CALLMIX,
+	CALLMIXSET,
+	CALLSESSION,
+	CALLSTATUS,
+	CALLTRACK
+};
+
+/*
+ * An API call.  Every call is sent by the event loop in curl.c, which also
+ * parses the response.  The callback of an asynchronous call runs on the
+ * event loop thread, or is queued for client_dispatch once the client has
+ * a completion descriptor.  A blocking call waits for call_done instead.
+ */
+struct call {
+	struct client	*client;	/* NULL for the default server */
+	struct session	*session;
+	int		 kind;
+	const char	*key;		/* of the mix in the response */
+	int		 play;		/* the session starts mix mixid */
+	int		 mixid;
+	int		 error;
+	long		 status;	/* of the response, see call_done */
+	struct mix	*mix;
+	struct mix	**mixes;
+	size_t		 size;
+	struct track	*track;
+	union {
+		void	(*mix)(int, struct mix *, void *);
+		void	(*mixset)(int, struct mix **, size_t, void *);
+		void	(*session)(int, struct session *, void *);
+		void	(*status)(int, void *);
+		void	(*track)(int, struct track *, void *);
+	} cb;
+	void		*arg;
+	int		 wait;		/* a thread waits in call_wait */
+	int		 done;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+	struct call	*next;		/* in the completion queue */
+};
+
+/*
+ * A client holds what the sessions of one API server share.  Only its
+ * completion queue changes after client_new, so any number of threads may
+ * use it at once.  The connections, the DNS cache and the response cache
+ * are shared by all clients, see curl.c and cache.c.
+ */
+struct client {
+	char		*server;	/* base URL of the API, ends in a slash */
+	pthread_mutex_t	 lock;
+	struct call	*done;		/* waiting for client_dispatch */
+	struct call	*lastdone;
+	int		 fd[2];		/* readable while done is not empty */
+};
+
+/*
+ * A listening session: a play token and the mix that it plays.  A session
+ * is used by one thread at a time and has at most one call in flight.
+ * Every session is independent of the others.
+ */
+struct session {
+	struct client	*client;
+	char		*playtoken;
+	int		 mixid;		/* the mix being played */
+};
+
+static pthread_once_t	 serveronce = PTHREAD_ONCE_INIT;
+static const char	*servername = SERVERNAME;
 
-static size_t	intlen(int);
-static struct	mix *mix_init(json_object *);
+static int	apiurl(char **, const char *, const char *, ...);
+static void	*arena_alloc(struct arena *, size_t);
+static char	*arena_strdup(struct arena *, json_object *);
+static int	call_detach(struct call *, int);
+static void	call_done(struct json_object *, long, void *);
+static void	call_init(struct call *, struct client *, int);
+static struct	call *call_new(struct client *, int, void *);
+static int	call_parse(struct call *, json_object *);
+static void	call_run(struct call *);
+static int	call_start(struct call *, int, char *, long);
+static int	call_wait(struct call *, int);
+static void	mix_batch(size_t, struct json_object *, void *);
+static int	mix_get(json_object *, const char *, struct mix **);
+static struct	mix *mix_init(json_object *, struct arena *);
+static int	mix_start(struct call *, const char *, const char *);
+static int	mix_startsimilar(struct call *, const char *, const char *,
+		    int);
+static int	mix_url(const char *, const char *, char **);
+static int	mixset_init(json_object *, struct mix ***, size_t *);
+static void	mixset_page(size_t, struct json_object *, void *);
+static int	mixset_start(struct call *, const char *, const char *, int,
+		    int);
+static int	mixset_url(const char *, const char *, int, int, char **);
+static int	report_start(struct call *, const char *, const char *, int,
+		    int);
+static const char *server(void);
+static void	server_init(void);
 static int	statusok(json_object *);
-static struct	track *track_get(const char *);
-static struct	track *track_init(json_object *);
-static void	*xmalloc(size_t);
+static int	token_get(json_object *, char **);
+static int	token_start(struct call *, const char *);
+static int	track_get(json_object *, struct track **);
+static struct	track *track_init(json_object *, struct arena *);
+static int	track_start(struct call *, const char *, const char *,
+		    const char *, int);
 
-char *
-getplaytoken(void)
+/*
+ * Formats the URL of an API call below base into a new string.
+ */
+static int
+apiurl(char **url, const char *base, const char *fmt, ...)
 {
-	struct json_object *root, *pt;
-	char *js, *playtoken = NULL, url[] = SERVERNAME "sets/new";
+	va_list ap;
 	size_t len;
+	int n;
 
-	js = curl_fetch(url, NULL);
-	root = json_tokener_parse(js);
-	if (root == NULL)
-		goto end;
-	if (!json_object_object_get_ex(root, "play_token", &pt))
-		goto end;
+	*url = NULL;
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return CLIENT_INVAL;
+	len = strlen(base);
+	if ((*url = malloc(len + n + 1)) == NULL)
+		return CLIENT_NOMEM;
+	memcpy(*url, base, len);
+	va_start(ap, fmt);
+	vsnprintf(*url + len, n + 1, fmt, ap);
+	va_end(ap);
+	return CLIENT_OK;
+}
 
-	len = json_object_get_string_len(pt) + 1;
-	playtoken = xmalloc(len);
-	memcpy(playtoken, json_object_get_string(pt), len);
-end:
-	if (root)
+/*
+ * Reserves size bytes in the arena.  Returns NULL while measuring.
+ */
+static void *
+arena_alloc(struct arena *a, size_t size)
+{
+	void *p;
+
+	p = a->base != NULL ? a->base + a->pos : NULL;
+	a->pos += ALIGN(size);
+	return p;
+}
+
+/*
+ * Copies a JSON string into the arena.  Returns NULL for JSON null.
+ */
+static char *
+arena_strdup(struct arena *a, json_object *o)
+{
+	const char *s;
+	char *p;
+	size_t len;
+
+	if ((s = json_object_get_string(o)) == NULL)
+		return NULL;
+	len = json_object_get_string_len(o) + 1;
+	if ((p = arena_alloc(a, len)) != NULL)
+		memcpy(p, s, len);
+	return p;
+}
+
+/*
+ * Leaves an asynchronous call that was started with error to the event
+ * loop, or frees it, along with its new session, if it was not started.
+ * Returns error.
+ */
+static int
+call_detach(struct call *c, int error)
+{
+	if (error != CLIENT_OK) {
+		if (c->kind == CALLSESSION)
+			session_free(c->session);
+		free(c);
+	}
+	return error;
+}
+
+/*
+ * Completes a call with the response of its request.  Runs on the event
+ * loop thread.
+ */
+static void
+call_done(struct json_object *root, long status, void *arg)
+{
+	struct call *c = arg;
+	struct client *cl = c->client;
+	json_object *s;
+	const char *p;
+
+	/* the API puts its own status in the body, which overrides HTTP's */
+	c->status = status;
+	if (root != NULL && json_object_object_get_ex(root, "status", &s) &&
+	    (p = json_object_get_string(s)) != NULL && atol(p) > 0)
+		c->status = atol(p);
+
+	if (root == NULL)
+		c->error = status == -1 ? CLIENT_NOMEM : CLIENT_REQUEST;
+	else if (!statusok(root))
+		c->error = CLIENT_STATUS;
+	else
+		c->error = call_parse(c, root);
+	if (root != NULL)
 		json_object_put(root);
-	free(js);
-	return playtoken;
+
+	if (c->wait) {
+		pthread_mutex_lock(&c->lock);
+		c->done = 1;
+		pthread_cond_signal(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	if (cl != NULL) {
+		pthread_mutex_lock(&cl->lock);
+		if (cl->fd[0] != -1) {
+			c->next = NULL;
+			if (cl->lastdone != NULL)
+				cl->lastdone->next = c;
+			else {
+				cl->done = c;
+				/* the queue was empty, wake up the reader */
+				while (write(cl->fd[1], "", 1) == -1 &&
+				    errno == EINTR)
+					continue;
+			}
+			cl->lastdone = c;
+			c = NULL;
+		}
+		pthread_mutex_unlock(&cl->lock);
+	}
+	if (c != NULL)
+		call_run(c);
+}
+
+/*
+ * Sets up a blocking call of kind.
+ */
+static void
+call_init(struct call *c, struct client *cl, int kind)
+{
+	memset(c, 0, sizeof(struct call));
+	c->client = cl;
+	c->kind = kind;
+	c->wait = 1;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+}
+
+/*
+ * Returns an asynchronous call of kind, or NULL if out of memory.
+ */
+static struct call *
+call_new(struct client *cl, int kind, void *arg)
+{
+	struct call *c;
+
+	if ((c = calloc(1, sizeof(struct call))) == NULL)
+		return NULL;
+	c->client = cl;
+	c->kind = kind;
+	c->arg = arg;
+	return c;
+}
+
+/*
+ * Takes the result of a call from a successful response.
+ */
+static int
+call_parse(struct call *c, json_object *root)
+{
+	int error = CLIENT_OK;
+
+	switch (c->kind) {
+	case CALLMIX:
+		error = mix_get(root, c->key, &c->mix);
+		break;
+	case CALLMIXSET:
+		error = mixset_init(root, &c->mixes, &c->size);
+		break;
+	case CALLSESSION:
+		error = token_get(root, &c->session->playtoken);
+		break;
+	case CALLTRACK:
+		error = track_get(root, &c->track);
+		if (error == CLIENT_OK && c->play)
+			c->session->mixid = c->mixid;
+		break;
+	default:
+		break;
+	}
+	return error;
+}
+
+/*
+ * Passes the result of an asynchronous call to its callback and frees the
+ * call.
+ */
+static void
+call_run(struct call *c)
+{
+	switch (c->kind) {
+	case CALLMIX:
+		c->cb.mix(c->error, c->mix, c->arg);
+		break;
+	case CALLMIXSET:
+		c->cb.mixset(c->error, c->mixes, c->mixes != NULL ? c->size : 0,
+		    c->arg);
+		break;
+	case CALLSESSION:
+		if (c->error != CLIENT_OK) {
+			session_free(c->session);
+			c->session = NULL;
+		}
+		c->cb.session(c->error, c->session, c->arg);
+		break;
+	case CALLSTATUS:
+		c->cb.status(c->error, c->arg);
+		break;
+	case CALLTRACK:
+		c->cb.track(c->error, c->track, c->arg);
+		break;
+	}
+	free(c);
+}
+
+/*
+ * Hands the request for url to the event loop, unless building url failed
+ * with error.  Returns the error, or CLIENT_NOMEM if the request could not
+ * be queued.
+ */
+static int
+call_start(struct call *c, int error, char *url, long ttl)
+{
+	if (error == CLIENT_OK &&
+	    curl_fetchasync(url, NULL, ttl, call_done, c) == -1)
+		error = CLIENT_NOMEM;
+	free(url);
+	return error;
+}
+
+/*
+ * Waits for a blocking call that was started with error and returns the
+ * error of the call.
+ */
+static int
+call_wait(struct call *c, int error)
+{
+	if (error == CLIENT_OK) {
+		pthread_mutex_lock(&c->lock);
+		while (!c->done)
+			pthread_cond_wait(&c->cond, &c->lock);
+		pthread_mutex_unlock(&c->lock);
+		error = c->error;
+	}
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->lock);
+	return error;
+}
+
+/*
+ * Runs the callbacks of the calls of c that have completed, in the order
+ * they completed.  Returns the number of callbacks run.
+ */
+int
+client_dispatch(struct client *c)
+{
+	struct call *done, *next;
+	char buf[64];
+	int n = 0;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->fd[0] != -1)
+		while (read(c->fd[0], buf, sizeof(buf)) > 0)
+			continue;
+	done = c->done;
+	c->done = c->lastdone = NULL;
+	pthread_mutex_unlock(&c->lock);
+	for (; done != NULL; done = next) {
+		next = done->next;
+		call_run(done);
+		n++;
+	}
+	return n;
 }
 
 /*
- * Returns the string size of an integer
+ * Returns a descriptor that is readable while calls of c wait for
+ * client_dispatch, or -1 if it cannot be created.  From the first call of
+ * client_fd on, the callbacks of c run in client_dispatch instead of on
+ * the event loop thread.
  */
-static size_t
-intlen(int i)
+int
+client_fd(struct client *c)
 {
-	size_t len = 1;
+	int fd[2];
 
-	if (i < 0)
-		i *= -1;
-	while (i > 9) {
-		len++;
-		i /= 10;
+	pthread_mutex_lock(&c->lock);
+	if (c->fd[0] == -1 && pipe(fd) == 0) {
+		fcntl(fd[0], F_SETFL, O_NONBLOCK);
+		fcntl(fd[1], F_SETFL, O_NONBLOCK);
+		c->fd[0] = fd[0];
+		c->fd[1] = fd[1];
 	}
-	return len;
+	fd[0] = c->fd[0];
+	pthread_mutex_unlock(&c->lock);
+	return fd[0];
 }
 
+/*
+ * Frees c and the results of the calls that wait for client_dispatch.  No
+ * call of c may be in flight.
+ */
 void
-mix_free(struct mix *mix)
+client_free(struct client *c)
 {
-	if (mix == NULL)
+	struct call *next;
+
+	if (c == NULL)
 		return;
-	free(mix->url);
-	free(mix->name);
-	free(mix->user);
-	free(mix->description);
-	free(mix->tags);
-	free(mix->certification);
-	free(mix);
+	for (; c->done != NULL; c->done = next) {
+		next = c->done->next;
+		mix_free(c->done->mix);
+		free(c->done->mixes);
+		track_free(c->done->track);
+		if (c->done->kind == CALLSESSION)
+			session_free(c->done->session);
+		free(c->done);
+	}
+	if (c->fd[0] != -1) {
+		close(c->fd[0]);
+		close(c->fd[1]);
+	}
+	pthread_mutex_destroy(&c->lock);
+	free(c->server);
+	free(c);
 }
 
-struct mix *
-mix_getbysimilar(int mixid, const char *playtoken)
+/*
+ * Looks up the mix at url, which is its URL on 8tracks.com or just the
+ * path of it.
+ */
+int
+client_getmix(struct client *c, const char *url, struct mix **mix)
 {
-	struct mix *m;
-	struct json_object *mix, *root;
-	char *js, *url;
+	struct call call;
+
+	call_init(&call, c, CALLMIX);
+	call.error = call_wait(&call, mix_start(&call, c->server, url));
+	*mix = call.mix;
+	return call.error;
+}
+
+/*
+ * Like client_getmix, but returns right away and passes the mix to cb.
+ */
+int
+client_getmixasync(struct client *c, const char *url,
+    void (*cb)(int, struct mix *, void *), void *arg)
+{
+	struct call *call;
+
+	if ((call = call_new(c, CALLMIX, arg)) == NULL)
+		return CLIENT_NOMEM;
+	call->cb.mix = cb;
+	return call_detach(call, mix_start(call, c->server, url));
+}
+
+/*
+ * Returns a client of the API at base, or of the default server if base is
+ * NULL.  Returns NULL if out of memory.
+ */
+struct client *
+client_new(const char *base)
+{
+	struct client *c;
 	size_t len;
-	int nr;
-
-	len = strlen(SERVERNAME) + strlen("sets/") + strlen(playtoken) +
-	    strlen("/next_mix?mix_id=") + intlen(mixid) +
-	    strlen("&include=user") + 1;
-	url = xmalloc(len);
-	nr = snprintf(url, len, "%ssets/%s/next_mix?mix_id=%d&include=user",
-	    SERVERNAME, playtoken, mixid);
-	if (nr == -1 || (size_t)nr >= len)
-		errx(1, "next mix URL too long");
-
-	js = curl_fetch(url, NULL);
-	free(url);
-	root = json_tokener_parse(js);
-	if (root == NULL)
-		goto error;
-	if (!statusok(root))
-		goto error;
-	if (!json_object_object_get_ex(root, "next_mix", &mix))
-		goto error;
-	m = mix_init(mix);
-	json_object_put(root);
-	free(js);
-	return m;
-error:
-	if (root)
+
+	if (base == NULL)
+		base = server();
+	if ((c = malloc(sizeof(struct client))) == NULL)
+		return NULL;
+	len = strlen(base);
+	if ((c->server = malloc(len + 2)) == NULL) {
+		free(c);
+		return NULL;
+	}
+	memcpy(c->server, base, len + 1);
+	pthread_mutex_init(&c->lock, NULL);
+	c->done = c->lastdone = NULL;
+	c->fd[0] = c->fd[1] = -1;
+	if (len == 0 || base[len - 1] != '/') {
+		c->server[len] = '/';
+		c->server[len + 1] = '\0';
+	}
+	return c;
+}
+
+/*
+ * Fetches page p of the mixes that match smartid, with pp mixes per page.
+ */
+int
+client_search(struct client *c, const char *smartid, int p, int pp,
+    struct mix ***mixes, size_t *size)
+{
+	struct call call;
+
+	call_init(&call, c, CALLMIXSET);
+	call.error = call_wait(&call,
+	    mixset_start(&call, c->server, smartid, p, pp));
+	*mixes = call.mixes;
+	*size = call.size;
+	return call.error;
+}
+
+/*
+ * Like client_search, but returns right away and passes the page to cb.
+ */
+int
+client_searchasync(struct client *c, const char *smartid, int p, int pp,
+    void (*cb)(int, struct mix **, size_t, void *), void *arg)
+{
+	struct call *call;
+
+	if ((call = call_new(c, CALLMIXSET, arg)) == NULL)
+		return CLIENT_NOMEM;
+	call->cb.mixset = cb;
+	return call_detach(call, mixset_start(call, c->server, smartid, p,
+	    pp));
+}
+
+const char *
+client_strerror(int error)
+{
+	static const char *msg[] = {
+		"no error",
+		"out of memory",
+		"invalid argument",
+		"request failed",
+		"refused by the server",
+		"not found"
+	};
+
+	if (error < 0 || (size_t)error >= sizeof(msg) / sizeof(msg[0]))
+		return "unknown error";
+	return msg[error];
+}
+
+char *
+getplaytoken(void)
+{
+	struct session s = { .playtoken = NULL };
+	struct call c;
+
+	call_init(&c, NULL, CALLSESSION);
+	c.session = &s;
+	call_wait(&c, token_start(&c, server()));
+	return s.playtoken;
+}
+
+/*
+ * Passes a mix fetched by mix_getbyurls on to its callback.
+ */
+static void
+mix_batch(size_t i, struct json_object *root, void *arg)
+{
+	struct batch *b = arg;
+	struct mix *m = NULL;
+
+	if (root != NULL) {
+		mix_get(root, "mix", &m);
 		json_object_put(root);
-	free(js);
-	return NULL;
+	}
+	b->cb(i, m, b->arg);
+}
+
+void
+mix_free(struct mix *mix)
+{
+	free(mix);	/* the strings live in the same block */
+}
+
+/*
+ * Returns the mix stored under key in an API response, in a block of its
+ * own.
+ */
+static int
+mix_get(json_object *root, const char *key, struct mix **mix)
+{
+	struct arena a = { NULL, 0 };
+	json_object *o;
+
+	*mix = NULL;
+	if (!statusok(root))
+		return CLIENT_STATUS;
+	if (!json_object_object_get_ex(root, key, &o))
+		return CLIENT_NOTFOUND;
+	mix_init(o, &a);
+	if (a.pos == 0)
+		return CLIENT_NOTFOUND;
+	if ((a.base = malloc(a.pos)) == NULL)
+		return CLIENT_NOMEM;
+	a.pos = 0;
+	*mix = mix_init(o, &a);
+	return CLIENT_OK;
+}
+
+struct mix *
+mix_getbysimilar(int mixid, const char *playtoken)
+{
+	struct call c;
+
+	call_init(&c, NULL, CALLMIX);
+	call_wait(&c, mix_startsimilar(&c, server(), playtoken, mixid));
+	return c.mix;
 }
 
 struct mix *
 mix_getbyurl(const char *url)
 {
-	struct mix *m;
-	struct json_object *mix, *root;
-	char *js, *path;
-	const char *p;
-	size_t len;
-	int nr;
+	struct call c;
 
-	/*
-	 * Check if the full URL is given or just the extension.
-	 * Let p point to the extension.
-	 */
-	p = strstr(url, "http://8tracks.com/");
-	if (p == &url[0])
-		p += strlen("http://8tracks.com/");
-	else if (p == NULL) {
-		/* if http fails, check against https */
-		p = strstr(url, "https://8tracks.com/");
-		if (p == &url[0])
-			p += strlen("https://8tracks.com/");
-		else
-			p = url;
-	}
+	call_init(&c, NULL, CALLMIX);
+	call_wait(&c, mix_start(&c, server(), url));
+	return c.mix;
+}
 
-	len = strlen(SERVERNAME) + strlen(p) + 1;
-	path = xmalloc(len);
-	nr = snprintf(path, len, "%s%s", SERVERNAME, p);
-	if (nr == -1 || (size_t)nr >= len)
-		errx(1, "mix URL too long");
+/*
+ * Looks up n mixes concurrently, with at most maxconn requests in flight,
+ * and calls cb with the index and the mix of every URL as it arrives, or in
+ * the order of urls when ordered is set.  cb is passed NULL for a mix that
+ * could not be found and has to free the mixes with mix_free.
+ */
+void
+mix_getbyurls(const char **urls, size_t n, int maxconn, int ordered,
+    void (*cb)(size_t, struct mix *, void *), void *arg)
+{
+	struct batch b = { .cb = cb, .arg = arg };
+	char **paths;
+	size_t i;
 
-	js = curl_fetch(path, NULL);
-	free(path);
-	root = json_tokener_parse(js);
-	if (root == NULL)
-		goto error;
-	if (!statusok(root))
+	if ((paths = calloc(n, sizeof(char *))) == NULL)
 		goto error;
-	if (!json_object_object_get_ex(root, "mix", &mix))
-		goto error;
-	m = mix_init(mix);
-	json_object_put(root);
-	free(js);
-	return m;
+	for (i = 0; i < n; ++i)
+		if (mix_url(server(), urls[i], &paths[i]) != CLIENT_OK)
+			goto error;
+	curl_fetchmany((const char **)paths, n, maxconn, ordered, MIXTTL,
+	    mix_batch, &b);
+	goto end;
 error:
-	if (root)
-		json_object_put(root);
-	free(js);
-	return NULL;
+	for (i = 0; i < n; ++i)
+		cb(i, NULL, arg);
+end:
+	for (i = 0; paths != NULL && i < n; ++i)
+		free(paths[i]);
+	free(paths);
 }
 
+/*
+ * Fills in a mix from the arena.  Returns NULL, without using the arena, if
+ * the JSON object is not a valid mix.
+ */
 static struct mix *
-mix_init(json_object *mix)
+mix_init(json_object *mix, struct arena *a)
 {
 	json_object *certification, *description, *duration, *id,
 	    *likescount, *name, *playscount, *tags, *trackscount, *url,
 	    *user, *userid, *username;
 	struct mix *m;
-	size_t len;
+	char *s[6];
 
-	m = xmalloc(sizeof(struct mix));
 	if (!json_object_object_get_ex(mix, "id", &id) ||
 	    !json_object_object_get_ex(mix, "web_path", &url) ||
 	    !json_object_object_get_ex(mix, "name", &name) ||
@@ -200,139 +739,540 @@ mix_init(json_object *mix)
 	    !json_object_object_get_ex(mix, "user", &user) ||
 	    !json_object_object_get_ex(user, "id", &userid) ||
 	    !json_object_object_get_ex(user, "login", &username))
-		goto error;
+		return NULL;
+
+	m = arena_alloc(a, sizeof(struct mix));
+	s[0] = arena_strdup(a, url);
+	s[1] = arena_strdup(a, name);
+	s[2] = arena_strdup(a, username);
+	s[3] = arena_strdup(a, description);
+	s[4] = arena_strdup(a, tags);
+	s[5] = arena_strdup(a, certification);
+	if (m == NULL)		/* measuring */
+		return NULL;
 
 	m->id = json_object_get_int(id);
-	if (json_object_get_string(url) != NULL) {
-		len = json_object_get_string_len(url) + 1;
-		m->url = xmalloc(len);
-		memcpy(m->url, json_object_get_string(url), len);
-	} else
-		m->url = NULL;
-	if (json_object_get_string(name) != NULL) {
-		len = json_object_get_string_len(name) + 1;
-		m->name = xmalloc(len);
-		memcpy(m->name, json_object_get_string(name), len);
-	} else
-		m->name = NULL;
+	m->url = s[0];
+	m->name = s[1];
 	m->userid = json_object_get_int(userid);
-	if (json_object_get_string(username) != NULL) {
-		len = json_object_get_string_len(username) + 1;
-		m->user = xmalloc(len);
-		memcpy(m->user, json_object_get_string(username), len);
-	} else
-		m->user = NULL;
-	if (json_object_get_string(description) != NULL) {
-		len = json_object_get_string_len(description) + 1;
-		m->description = xmalloc(len);
-		memcpy(m->description, json_object_get_string(description),
-		    len);
-	} else
-		m->description = NULL;
-	if (json_object_get_string(tags) != NULL) {
-		len = json_object_get_string_len(tags) + 1;
-		m->tags = xmalloc(len);
-		memcpy(m->tags, json_object_get_string(tags), len);
-	} else
-		m->tags = NULL;
-	if (json_object_get_string(certification) != NULL) {
-		len = json_object_get_string_len(certification) + 1;
-		m->certification = xmalloc(len);
-		memcpy(m->certification, json_object_get_string(certification),
-		    len);
-	} else
-		m->certification = NULL;
+	m->user = s[2];
+	m->description = s[3];
+	m->tags = s[4];
+	m->certification = s[5];
 	m->likescount = json_object_get_int(likescount);
 	m->playscount = json_object_get_int(playscount);
 	m->trackscount = json_object_get_int(trackscount);
 	m->duration = json_object_get_int(duration);
-
 	return m;
-error:
-	free(m);
-	return NULL;
+}
+
+/*
+ * Starts looking up the mix at url.
+ */
+static int
+mix_start(struct call *c, const char *base, const char *url)
+{
+	char *path;
+	int error;
+
+	c->key = "mix";
+	error = mix_url(base, url, &path);
+	return call_start(c, error, path, MIXTTL);
+}
+
+/*
+ * Starts asking for the mix that the server suggests to play after mix
+ * mixid.
+ */
+static int
+mix_startsimilar(struct call *c, const char *base, const char *playtoken,
+    int mixid)
+{
+	char *url;
+	int error;
+
+	c->key = "next_mix";
+	error = apiurl(&url, base, "sets/%s/next_mix?mix_id=%d&include=user",
+	    playtoken, mixid);
+	return call_start(c, error, url, -1);
+}
+
+/*
+ * Returns the API URL of a mix given by its URL on 8tracks.com, or just the
+ * path of it.
+ */
+static int
+mix_url(const char *base, const char *url, char **path)
+{
+	const char *p;
+
+	/*
+	 * Check if the full URL is given or just the extension.
+	 * Let p point to the extension.
+	 */
+	p = strstr(url, "http://8tracks.com/");
+	if (p == &url[0])
+		p += strlen("http://8tracks.com/");
+	else if (p == NULL) {
+		/* if http fails, check against https */
+		p = strstr(url, "https://8tracks.com/");
+		if (p == &url[0])
+			p += strlen("https://8tracks.com/");
+		else
+			p = url;
+	}
+	return apiurl(path, base, "%s", p);
 }
 
 void
 mixset_free(struct mix ***mix, size_t size)
 {
+	(void)size;
+	free(*mix);	/* the mixes live in the same block */
+}
+
+/*
+ * Builds the records of a mix set page in one block.
+ */
+static int
+mixset_init(json_object *root, struct mix ***mixes, size_t *size)
+{
+	struct arena a = { NULL, 0 };
+	struct mix **m;
+	json_object *mixset, *o;
 	size_t i;
 
-	for (i = 0; i < size; ++i)
-		mix_free((*mix)[i]);
-	free(*mix);
+	*mixes = NULL;
+	if (!statusok(root))
+		return CLIENT_STATUS;
+	if (!json_object_object_get_ex(root, "mix_set", &mixset) ||
+	    !json_object_object_get_ex(mixset, "mixes", &o))
+		return CLIENT_NOTFOUND;
+	*size = json_object_array_length(o);
+
+	/* measure, then build the array and all mixes in one block */
+	arena_alloc(&a, *size * sizeof(struct mix *));
+	for (i = 0; i < *size; ++i)
+		mix_init(json_object_array_get_idx(o, i), &a);
+	if ((a.base = malloc(a.pos > 0 ? a.pos : 1)) == NULL)
+		return CLIENT_NOMEM;
+	a.pos = 0;
+	m = arena_alloc(&a, *size * sizeof(struct mix *));
+	for (i = 0; i < *size; ++i)
+		m[i] = mix_init(json_object_array_get_idx(o, i), &a);
+	*mixes = m;
+	return CLIENT_OK;
+}
+
+/*
+ * Passes a page fetched by mixset_searchpages on to its callback.
+ */
+static void
+mixset_page(size_t i, struct json_object *root, void *arg)
+{
+	struct pages *pg = arg;
+	struct mix **m = NULL;
+	size_t size = 0;
+
+	if (root != NULL) {
+		mixset_init(root, &m, &size);
+		json_object_put(root);
+	}
+	pg->cb(pg->first + (int)i, m, m != NULL ? size : 0, pg->arg);
 }
 
 struct mix **
 mixset_searchbysmartid(const char *smartid, int p, int pp, size_t *size)
 {
-	struct mix **m;
-	json_object *root = NULL, *mixset, *mixes;
-	char *js, *url;
-	size_t len;
-	int i, nr;
+	struct call c;
+
+	call_init(&c, NULL, CALLMIXSET);
+	call_wait(&c, mixset_start(&c, server(), smartid, p, pp));
+	*size = c.size;
+	return c.mixes;
+}
+
+/*
+ * Fetches the pages first up to and including last concurrently, with at
+ * most maxconn requests in flight, and calls cb for every page in order.
+ * If last is 0 or less, all pages are fetched: the first page tells how
+ * many there are.  cb is passed NULL for a page that could not be loaded
+ * and has to free the mixes with mixset_free.  Returns the number of
+ * pages, or -1 if the number of pages could not be determined.
+ */
+int
+mixset_searchpages(const char *smartid, int first, int last, int pp,
+    int maxconn, void (*cb)(int, struct mix **, size_t, void *), void *arg)
+{
+	struct pages pg = { .cb = cb, .arg = arg };
+	json_object *mixset, *pagination, *root, *total;
+	char **urls, *url;
+	int i, n;
+
+	if (first <= 0)
+		first = 1;
+	if (last <= 0) {
+		if (mixset_url(server(), smartid, first, pp, &url) != CLIENT_OK)
+			return -1;
+		root = curl_fetchcached(url, MIXTTL);
+		free(url);
+		if (root == NULL ||
+		    !json_object_object_get_ex(root, "mix_set", &mixset) ||
+		    !json_object_object_get_ex(mixset, "pagination",
+		    &pagination) ||
+		    !json_object_object_get_ex(pagination, "total_pages",
+		    &total)) {
+			if (root)
+				json_object_put(root);
+			return -1;
+		}
+		last = json_object_get_int(total);
+		pg.first = first;
+		mixset_page(0, root, &pg);
+		first++;
+	}
+	if (last < first)
+		return last;
+
+	n = last - first + 1;
+	if ((urls = calloc(n, sizeof(char *))) == NULL)
+		return -1;
+	for (i = 0; i < n; ++i) {
+		if (mixset_url(server(), smartid, first + i, pp, &urls[i]) !=
+		    CLIENT_OK) {
+			last = -1;
+			goto end;
+		}
+	}
+	pg.first = first;
+	curl_fetchmany((const char **)urls, (size_t)n, maxconn, 1, MIXTTL,
+	    mixset_page, &pg);
+end:
+	for (i = 0; i < n; ++i)
+		free(urls[i]);
+	free(urls);
+	return last;
+}
+
+/*
+ * Starts fetching page p of a mix set, with pp mixes per page.
+ */
+static int
+mixset_start(struct call *c, const char *base, const char *smartid, int p,
+    int pp)
+{
+	char *url;
+	int error;
+
+	error = mixset_url(base, smartid, p, pp, &url);
+	return call_start(c, error, url, MIXTTL);
+}
 
+/*
+ * Returns the URL of page p of a mix set, with pp mixes per page.
+ */
+static int
+mixset_url(const char *base, const char *smartid, int p, int pp,
+    char **url)
+{
 	if (p <= 0)
 		p = 1;
 	if (pp <= 0)
 		pp = 12;
-
-	len = strlen(SERVERNAME) + strlen("mix_sets/") + strlen(smartid) +
-	    strlen("?include=mixes[user]+pagination&page=") + intlen(p) +
-	    strlen("&per_page=") + intlen(pp) + 1;
-	url = xmalloc(len);
-	nr = snprintf(url, len,
-	    "%smix_sets/%s?include=mixes[user]+pagination&page=%d&per_page=%d",
-	    SERVERNAME, smartid, p, pp);
-	if (nr == -1 || (size_t)nr >= len)
-		errx(1, "search by smartid url too long");
-
-	js = curl_fetch(url, NULL);
-	free(url);
-	if (js == NULL)
-		goto error;
-	root = json_tokener_parse(js);
-	if (root == NULL)
-		goto error;
-	if (!statusok(root))
-		goto error;
-	if (!json_object_object_get_ex(root, "mix_set", &mixset) ||
-	    !json_object_object_get_ex(mixset, "mixes", &mixes))
-		goto error;
-	*size = json_object_array_length(mixes);
-	m = xmalloc(*size * sizeof(struct mix *));
-	for (i = 0; (size_t)i < *size; ++i)
-		m[i] = mix_init(json_object_array_get_idx(mixes, i));
-	json_object_put(root);
-	free(js);
-	return m;
-error:
-	if (root)
-		json_object_put(root);
-	free(js);
-	return NULL;
+	return apiurl(url, base,
+	    "mix_sets/%s?include=mixes[user]+pagination&page=%d&per_page=%d",
+	    smartid, p, pp);
 }
 
-void
+/*
+ * Reports a track as played.  Returns 0 on success, 1 if the server
+ * refused the report with a client error, and -1 if it did not answer or
+ * failed for a reason that may pass, such as a 5xx or 429 status, in which
+ * case the report may be sent again.
+ */
+int
 report(int trackid, int mixid, const char *playtoken)
 {
-	char *js, *url;
+	struct call c;
+
+	call_init(&c, NULL, CALLSTATUS);
+	switch (call_wait(&c, report_start(&c, server(), playtoken, trackid,
+	    mixid))) {
+	case CLIENT_OK:
+		return 0;
+	case CLIENT_STATUS:
+		if (c.status >= 400 && c.status < 500 && c.status != 408 &&
+		    c.status != 429)
+			return 1;
+		return -1;
+	case CLIENT_NOMEM:
+	case CLIENT_REQUEST:
+		return -1;
+	default:
+		return 1;
+	}
+}
+
+static int
+report_start(struct call *c, const char *base, const char *playtoken,
+    int trackid, int mixid)
+{
+	char *url;
+	int error;
+
+	error = apiurl(&url, base, "sets/%s/report?track_id=%d&mix_id=%d",
+	    playtoken, trackid, mixid);
+	return call_start(c, error, url, -1);
+}
+
+/*
+ * Returns the base URL of the API.
+ */
+static const char *
+server(void)
+{
+	pthread_once(&serveronce, server_init);
+	return servername;
+}
+
+/*
+ * The API is served by 8tracks.com, unless EIGHTPLAY_SERVER names another
+ * server, such as a local stand-in for testing.
+ */
+static void
+server_init(void)
+{
+	const char *s;
+	char *p;
 	size_t len;
-	int nr;
 
-	len = strlen(SERVERNAME) + strlen("sets/") + strlen(playtoken) +
-	    strlen("/report?track_id=") + intlen(trackid) +
-	    strlen("&mix_id=") + intlen(mixid) + 1;
-	url = xmalloc(len);
-	nr = snprintf(url, len, "%ssets/%s/report?track_id=%d&mix_id=%d",
-	    SERVERNAME, playtoken, trackid, mixid);
-	if (nr == -1 || (size_t)nr >= len)
-		errx(1, "report url too long");
+	if ((s = getenv("EIGHTPLAY_SERVER")) == NULL || *s == '\0')
+		return;
+	len = strlen(s);
+	if (s[len - 1] == '/') {
+		servername = s;
+		return;
+	}
+	/* keep the default if out of memory */
+	if ((p = malloc(len + 2)) == NULL)
+		return;
+	memcpy(p, s, len);
+	p[len] = '/';
+	p[len + 1] = '\0';
+	servername = p;
+}
+
+void
+session_free(struct session *s)
+{
+	if (s == NULL)
+		return;
+	free(s->playtoken);
+	free(s);
+}
 
-	js = curl_fetch(url, NULL);
+const char *
+session_getplaytoken(const struct session *s)
+{
+	return s->playtoken;
+}
 
-	free(js);
-	free(url);
+/*
+ * Returns the mix that the server suggests to play after the one that the
+ * session plays.
+ */
+int
+session_getsimilar(struct session *s, struct mix **mix)
+{
+	struct call c;
+
+	call_init(&c, s->client, CALLMIX);
+	c.error = call_wait(&c, mix_startsimilar(&c, s->client->server,
+	    s->playtoken, s->mixid));
+	*mix = c.mix;
+	return c.error;
+}
+
+int
+session_getsimilarasync(struct session *s,
+    void (*cb)(int, struct mix *, void *), void *arg)
+{
+	struct call *c;
+
+	if ((c = call_new(s->client, CALLMIX, arg)) == NULL)
+		return CLIENT_NOMEM;
+	c->cb.mix = cb;
+	return call_detach(c, mix_startsimilar(c, s->client->server,
+	    s->playtoken, s->mixid));
+}
+
+/*
+ * Starts a session of client c with playtoken, or with a new play token
+ * from the server if playtoken is NULL.
+ */
+int
+session_new(struct client *c, const char *playtoken, struct session **s)
+{
+	struct call call;
+	int error;
+
+	if ((*s = calloc(1, sizeof(struct session))) == NULL)
+		return CLIENT_NOMEM;
+	(*s)->client = c;
+	if (playtoken != NULL) {
+		error = ((*s)->playtoken = strdup(playtoken)) == NULL ?
+		    CLIENT_NOMEM : CLIENT_OK;
+	} else {
+		call_init(&call, c, CALLSESSION);
+		call.session = *s;
+		error = call_wait(&call, token_start(&call, c->server));
+	}
+	if (error != CLIENT_OK) {
+		session_free(*s);
+		*s = NULL;
+	}
+	return error;
+}
+
+/*
+ * Like session_new with a new play token, but returns right away and
+ * passes the session to cb.
+ */
+int
+session_newasync(struct client *c, void (*cb)(int, struct session *, void *),
+    void *arg)
+{
+	struct call *call;
+
+	if ((call = call_new(c, CALLSESSION, arg)) == NULL)
+		return CLIENT_NOMEM;
+	if ((call->session = calloc(1, sizeof(struct session))) == NULL) {
+		free(call);
+		return CLIENT_NOMEM;
+	}
+	call->session->client = c;
+	call->cb.session = cb;
+	return call_detach(call, token_start(call, c->server));
+}
+
+/*
+ * Returns the track that follows the one that has played.
+ */
+int
+session_next(struct session *s, struct track **track)
+{
+	struct call c;
+
+	call_init(&c, s->client, CALLTRACK);
+	c.session = s;
+	c.error = call_wait(&c, track_start(&c, s->client->server,
+	    s->playtoken, "next", s->mixid));
+	*track = c.track;
+	return c.error;
+}
+
+int
+session_nextasync(struct session *s,
+    void (*cb)(int, struct track *, void *), void *arg)
+{
+	struct call *c;
+
+	if ((c = call_new(s->client, CALLTRACK, arg)) == NULL)
+		return CLIENT_NOMEM;
+	c->session = s;
+	c->cb.track = cb;
+	return call_detach(c, track_start(c, s->client->server, s->playtoken,
+	    "next", s->mixid));
+}
+
+/*
+ * Starts playing mix mixid and returns its first track.
+ */
+int
+session_play(struct session *s, int mixid, struct track **track)
+{
+	struct call c;
+
+	call_init(&c, s->client, CALLTRACK);
+	c.session = s;
+	c.play = 1;
+	c.mixid = mixid;
+	c.error = call_wait(&c, track_start(&c, s->client->server,
+	    s->playtoken, "play", mixid));
+	*track = c.track;
+	return c.error;
+}
+
+int
+session_playasync(struct session *s, int mixid,
+    void (*cb)(int, struct track *, void *), void *arg)
+{
+	struct call *c;
+
+	if ((c = call_new(s->client, CALLTRACK, arg)) == NULL)
+		return CLIENT_NOMEM;
+	c->session = s;
+	c->cb.track = cb;
+	c->play = 1;
+	c->mixid = mixid;
+	return call_detach(c, track_start(c, s->client->server, s->playtoken,
+	    "play", mixid));
+}
+
+/*
+ * Reports track trackid of the mix that the session plays as played.
+ */
+int
+session_report(struct session *s, int trackid)
+{
+	struct call c;
+
+	call_init(&c, s->client, CALLSTATUS);
+	return call_wait(&c, report_start(&c, s->client->server,
+	    s->playtoken, trackid, s->mixid));
+}
+
+int
+session_reportasync(struct session *s, int trackid,
+    void (*cb)(int, void *), void *arg)
+{
+	struct call *c;
+
+	if ((c = call_new(s->client, CALLSTATUS, arg)) == NULL)
+		return CLIENT_NOMEM;
+	c->cb.status = cb;
+	return call_detach(c, report_start(c, s->client->server,
+	    s->playtoken, trackid, s->mixid));
+}
+
+/*
+ * Skips the track that is playing and returns the one after it.
+ */
+int
+session_skip(struct session *s, struct track **track)
+{
+	struct call c;
+
+	call_init(&c, s->client, CALLTRACK);
+	c.session = s;
+	c.error = call_wait(&c, track_start(&c, s->client->server,
+	    s->playtoken, "skip", s->mixid));
+	*track = c.track;
+	return c.error;
+}
+
+int
+session_skipasync(struct session *s,
+    void (*cb)(int, struct track *, void *), void *arg)
+{
+	struct call *c;
+
+	if ((c = call_new(s->client, CALLTRACK, arg)) == NULL)
+		return CLIENT_NOMEM;
+	c->session = s;
+	c->cb.track = cb;
+	return call_detach(c, track_start(c, s->client->server, s->playtoken,
+	    "skip", s->mixid));
 }
 
 static int
@@ -349,118 +1289,103 @@ statusok(json_object *root)
 	return ret;
 }
 
+/*
+ * Copies the play token out of a response to sets/new.
+ */
+static int
+token_get(json_object *root, char **playtoken)
+{
+	json_object *pt;
+	size_t len;
+
+	if (!json_object_object_get_ex(root, "play_token", &pt))
+		return CLIENT_NOTFOUND;
+	len = json_object_get_string_len(pt) + 1;
+	if ((*playtoken = malloc(len)) == NULL)
+		return CLIENT_NOMEM;
+	memcpy(*playtoken, json_object_get_string(pt), len);
+	return CLIENT_OK;
+}
+
+/*
+ * Starts asking the server for a new play token.
+ */
+static int
+token_start(struct call *c, const char *base)
+{
+	char *url;
+	int error;
+
+	error = apiurl(&url, base, "sets/new");
+	return call_start(c, error, url, -1);
+}
+
 void
 track_free(struct track *t)
 {
-	if (t == NULL)
-		return;
-	free(t->name);
-	free(t->performer);
-	free(t->url);
-	free(t);
+	free(t);	/* the strings live in the same block */
 }
 
-static struct track *
-track_get(const char *url)
+/*
+ * Returns the track in a response to a play command, in a block of its
+ * own.
+ */
+static int
+track_get(json_object *root, struct track **track)
 {
-	struct track *t;
-	json_object *root;
-	char *js;
+	struct arena a = { NULL, 0 };
 
-	js = curl_fetch(url, NULL);
-	root = json_tokener_parse(js);
-	if (root == NULL)
-		goto error;
-	if (!statusok(root))
-		goto error;
-	t = track_init(root);
-	json_object_put(root);
-	free(js);
-	return t;
-error:
-	if (root)
-		json_object_put(root);
-	free(js);
-	return NULL;
+	track_init(root, &a);
+	if (a.pos == 0)
+		return CLIENT_NOTFOUND;
+	if ((a.base = malloc(a.pos)) == NULL)
+		return CLIENT_NOMEM;
+	a.pos = 0;
+	*track = track_init(root, &a);
+	return CLIENT_OK;
 }
 
 struct track *
 track_getfirst(int mixid, const char *playtoken)
 {
-	struct track *track;
-	char *url;
-	size_t len;
-	int nr;
-
-	/* URL: 8tracks.com/sets/[playtoken]/play?mix_id=[mixid] */
-	len = strlen(SERVERNAME) + strlen("sets/") + strlen(playtoken) +
-	    strlen("/play?mix_id=") + intlen(mixid) + 1;
-	url = xmalloc(len);
-	nr = snprintf(url, len, "%ssets/%s/play?mix_id=%d",
-	    SERVERNAME, playtoken, mixid);
-	if (nr == -1 || nr >= (int)len)
-		errx(1, "first track URL too long");
+	struct call c;
 
-	track = track_get(url);
-
-	free(url);
-	return track;
+	call_init(&c, NULL, CALLTRACK);
+	call_wait(&c, track_start(&c, server(), playtoken, "play", mixid));
+	return c.track;
 }
 
 struct track *
 track_getnext(int mixid, const char *playtoken)
 {
-	struct track *track;
-	char *url;
-	size_t len;
-	int nr;
+	struct call c;
 
-	/* URL: 8tracks.com/sets/[playtoken]/next?mix_id=[mixid] */
-	len = strlen(SERVERNAME) + strlen("sets/") + strlen(playtoken) +
-	    strlen("/next?mix_id=") + intlen(mixid) + 1;
-	url = xmalloc(len);
-	nr = snprintf(url, len, "%ssets/%s/next?mix_id=%d",
-	    SERVERNAME, playtoken, mixid);
-	if (nr == -1 || (size_t)nr >= len)
-		errx(1, "next track URL too long");
-
-	track = track_get(url);
-
-	free(url);
-	return track;
+	call_init(&c, NULL, CALLTRACK);
+	call_wait(&c, track_start(&c, server(), playtoken, "next", mixid));
+	return c.track;
 }
 
 struct track *
 track_getskip(int mixid, const char *playtoken)
 {
-	struct track *track;
-	char *url;
-	size_t len;
-	int nr;
-
-	/* URL: 8tracks.com/sets/[playtoken]/skip?mix_id=[mixid] */
-	len = strlen(SERVERNAME) + strlen("sets/") + strlen(playtoken) +
-	    strlen("/skip?mix_id=") + intlen(mixid) + 1;
-	url = xmalloc(len);
-	nr = snprintf(url, len, "%ssets/%s/skip?mix_id=%d",
-	    SERVERNAME, playtoken, mixid);
-	if (nr == -1 || (size_t)nr >= len)
-		errx(1, "skip track URL too long");
-
-	track = track_get(url);
+	struct call c;
 
-	free(url);
-	return track;
+	call_init(&c, NULL, CALLTRACK);
+	call_wait(&c, track_start(&c, server(), playtoken, "skip", mixid));
+	return c.track;
 }
 
+/*
+ * Fills in a track from the arena.  Returns NULL, without using the arena,
+ * if the JSON object does not hold a valid track.
+ */
 static struct track *
-track_init(json_object *root)
+track_init(json_object *root, struct arena *a)
 {
 	json_object *id, *last, *name, *performer, *set, *skip, *track, *url;
 	struct track *t;
-	size_t len;
+	char *s[3];
 
-	t = xmalloc(sizeof(struct track));
 	if (!json_object_object_get_ex(root, "set", &set) ||
 	    !json_object_object_get_ex(set, "track", &track) ||
 	    !json_object_object_get_ex(track, "id", &id) ||
@@ -469,43 +1394,37 @@ track_init(json_object *root)
 	    !json_object_object_get_ex(track, "name", &name) ||
 	    !json_object_object_get_ex(track, "performer", &performer) ||
 	    !json_object_object_get_ex(track, "track_file_stream_url", &url))
-		goto error;
+		return NULL;
+
+	t = arena_alloc(a, sizeof(struct track));
+	s[0] = arena_strdup(a, name);
+	s[1] = arena_strdup(a, performer);
+	s[2] = arena_strdup(a, url);
+	if (t == NULL)		/* measuring */
+		return NULL;
 
 	t->id = json_object_get_int(id);
-	if (json_object_get_string(name) != NULL) {
-		len = json_object_get_string_len(name) + 1;
-		t->name = xmalloc(len);
-		memcpy(t->name, json_object_get_string(name), len);
-	} else
-		t->name = NULL;
-	if (json_object_get_string(performer) != NULL) {
-		len = json_object_get_string_len(performer) + 1;
-		t->performer = xmalloc(len);
-		memcpy(t->performer, json_object_get_string(performer), len);
-	} else
-		t->performer = NULL;
-	if (json_object_get_string(url) != NULL) {
-		len = json_object_get_string_len(url) + 1;
-		t->url = xmalloc(len);
-		memcpy(t->url, json_object_get_string(url), len);
-	} else
-		t->url = NULL;
+	t->name = s[0];
+	t->performer = s[1];
+	t->url = s[2];
 	t->lastflag = (int)json_object_get_boolean(last);
 	t->skipallowedflag = (int)json_object_get_boolean(skip);
 	return t;
-error:
-	free(t);
-	return NULL;
 }
 
-static void *
-xmalloc(size_t size)
+/*
+ * Starts sending the play command cmd, such as play, next or skip, for mix
+ * mixid.
+ */
+static int
+track_start(struct call *c, const char *base, const char *playtoken,
+    const char *cmd, int mixid)
 {
-	void *p;
+	char *url;
+	int error;
 
-	p = malloc(size);
-	if (p == NULL)
-		err(1, NULL);
-	return p;
+	/* URL: 8tracks.com/sets/[playtoken]/[cmd]?mix_id=[mixid] */
+	error = apiurl(&url, base, "sets/%s/%s?mix_id=%d", playtoken, cmd,
+	    mixid);
+	return call_start(c, error, url, -1);
 }
-
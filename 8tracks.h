@@ -40,16 +40,68 @@ struct track {
 	int	skipallowedflag;
 };
 
+/* the errors returned by the client and session functions */
+enum clienterror {
+	CLIENT_OK,
+	CLIENT_NOMEM,		/* out of memory */
+	CLIENT_INVAL,		/* an argument cannot be sent */
+	CLIENT_REQUEST,		/* no valid response from the server */
+	CLIENT_STATUS,		/* the server refused the request */
+	CLIENT_NOTFOUND		/* no mix or track in the response */
+};
+
+struct client;
+struct session;
+
 __BEGIN_DECLS
 
+int	client_dispatch(struct client *c);
+int	client_fd(struct client *c);
+void	client_free(struct client *c);
+int	client_getmix(struct client *c, const char *url, struct mix **mix);
+int	client_getmixasync(struct client *c, const char *url,
+    void (*cb)(int error, struct mix *mix, void *arg), void *arg);
+struct	client *client_new(const char *server);
+int	client_search(struct client *c, const char *smartid, int p, int pp,
+    struct mix ***mixes, size_t *size);
+int	client_searchasync(struct client *c, const char *smartid, int p,
+    int pp, void (*cb)(int error, struct mix **mixes, size_t size,
+    void *arg), void *arg);
+const char *client_strerror(int error);
 char	*getplaytoken(void);
 void	mix_free(struct mix *mix);
 struct	mix *mix_getbysimilar(int mixid, const char *playtoken);
 struct	mix *mix_getbyurl(const char *url);
+void	mix_getbyurls(const char **urls, size_t n, int maxconn, int ordered,
+    void (*cb)(size_t i, struct mix *mix, void *arg), void *arg);
 void	mixset_free(struct mix ***mix, size_t size);
 struct	mix **mixset_searchbysmartid(const char *smartid, int p, int pp,
     size_t *size);
-void	report(int trackid, int mixid, const char *playtoken);
+int	mixset_searchpages(const char *smartid, int first, int last, int pp,
+    int maxconn, void (*cb)(int page, struct mix **mix, size_t size,
+    void *arg), void *arg);
+int	report(int trackid, int mixid, const char *playtoken);
+void	session_free(struct session *s);
+const char *session_getplaytoken(const struct session *s);
+int	session_getsimilar(struct session *s, struct mix **mix);
+int	session_getsimilarasync(struct session *s,
+    void (*cb)(int error, struct mix *mix, void *arg), void *arg);
+int	session_new(struct client *c, const char *playtoken,
+    struct session **s);
+int	session_newasync(struct client *c,
+    void (*cb)(int error, struct session *s, void *arg), void *arg);
+int	session_next(struct session *s, struct track **track);
+int	session_nextasync(struct session *s,
+    void (*cb)(int error, struct track *track, void *arg), void *arg);
+int	session_play(struct session *s, int mixid, struct track **track);
+int	session_playasync(struct session *s, int mixid,
+    void (*cb)(int error, struct track *track, void *arg), void *arg);
+int	session_report(struct session *s, int trackid);
+int	session_reportasync(struct session *s, int trackid,
+    void (*cb)(int error, void *arg), void *arg);
+int	session_skip(struct session *s, struct track **track);
+int	session_skipasync(struct session *s,
+    void (*cb)(int error, struct track *track, void *arg), void *arg);
 void	track_free(struct track *track);
 struct	track *track_getfirst(int mixid, const char *playtoken);
 struct	track *track_getnext(int mixid, const char *playtoken);
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2015 Johannes Postma <jgmpostma@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The responses of the corpus, as read by the benchmarks and served by the
+ * stand-in server.  Besides the recorded responses there are mix set pages
+ * of any size, made from the mixes of the recorded page.
+ */
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <json.h>
+
+#include "corpus.h"
+
+/*
+ * Returns the contents of file in dir, NUL-terminated, and stores its
+ * length in len.
+ */
+char *
+corpus_load(const char *dir, const char *file, size_t *len)
+{
+	FILE *fp;
+	char *path, *text;
+	long size;
+	size_t n;
+
+	n = strlen(dir) + strlen(file) + 2;
+	if ((path = malloc(n)) == NULL)
+		err(1, NULL);
+	snprintf(path, n, "%s/%s", dir, file);
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	if (fseek(fp, 0, SEEK_END) == -1 || (size = ftell(fp)) == -1)
+		err(1, "%s", path);
+	rewind(fp);
+	*len = (size_t)size;
+	if ((text = malloc(*len + 1)) == NULL)
+		err(1, NULL);
+	if (fread(text, 1, *len, fp) != *len)
+		errx(1, "%s: short read", path);
+	text[*len] = '\0';
+	fclose(fp);
+	free(path);
+	return text;
+}
+
+/*
+ * Returns a mix set page of n mixes, the mixes of mixset.json in dir
+ * repeated, and stores its length in len.
+ */
+char *
+corpus_mixset(const char *dir, size_t n, size_t *len)
+{
+	struct json_object *root, *set, *mixes, *page, *pagination;
+	const char *s;
+	char *text;
+	size_t i, k;
+
+	text = corpus_load(dir, "mixset.json", len);
+	if ((root = json_tokener_parse(text)) == NULL ||
+	    !json_object_object_get_ex(root, "mix_set", &set) ||
+	    !json_object_object_get_ex(set, "mixes", &mixes) ||
+	    (k = json_object_array_length(mixes)) == 0)
+		errx(1, "%s/mixset.json: no mixes", dir);
+	free(text);
+
+	if ((page = json_object_new_array()) == NULL)
+		err(1, NULL);
+	for (i = 0; i < n; ++i)
+		json_object_array_add(page,
+		    json_object_get(json_object_array_get_idx(mixes, i % k)));
+	json_object_object_add(set, "mixes", page);
+	if (json_object_object_get_ex(set, "pagination", &pagination))
+		json_object_object_add(pagination, "per_page",
+		    json_object_new_int((int)n));
+
+	s = json_object_to_json_string_ext(root, JSON_C_TO_STRING_PLAIN);
+	if (s == NULL || (text = strdup(s)) == NULL)
+		err(1, NULL);
+	*len = strlen(text);
+	json_object_put(root);
+	return text;
+}
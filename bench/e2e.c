@@ -0,0 +1,851 @@
+/*
+ * Copyright (c) 2015 Johannes Postma <jgmpostma@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * End to end benchmark of the client against the server in
+ * EIGHTPLAY_SERVER, which is meant to be the stand-in server in this
+ * directory.  Every scenario is run in a process of its own, so that the
+ * peak resident set size it reports is its own, and prints what it
+ * measured as lines of a metric name and a value.  The metrics are then
+ * checked against the limits in the baseline file: lines of a metric name,
+ * < or >, and a limit.  The exit status is 1 if a scenario failed or a
+ * metric crossed its limit.
+ */
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <ftw.h>
+#include <json.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+
+#include "8tracks.h"
+#include "cache.h"
+#include "curl.h"
+
+#define BIGPAGE		10000	/* mixes on a large search page */
+#define BIGROUNDS	5
+#define INFLIGHT	64	/* calls in flight at once */
+#define JOBS		4	/* concurrent requests, as 8play -Q */
+#define METRICMAX	64	/* metrics measured by all scenarios */
+#define RETRYROUNDS	10	/* lookups that fail once, each a backoff */
+#define ROUNDS		500
+#define SMARTID		"tags:chill:popular"
+
+struct metric {
+	char	name[64];
+	double	value;
+};
+
+/* a track stream being received */
+struct stream {
+	double	start;
+	double	first;		/* when the first byte came in */
+	size_t	bytes;
+};
+
+/* the calls of the async scenario */
+struct calls {
+	struct client	*client;
+	int		 started;
+	int		 done;
+	int		 failed;
+};
+
+/* a response body being received whole */
+struct body {
+	char	*text;
+	size_t	 len;
+};
+
+struct scenario {
+	const char	*name;
+	void		(*run)(FILE *);
+};
+
+extern char		*__progname;
+static const char	*server;
+static int		 rounds = ROUNDS;
+static struct metric	 metrics[METRICMAX];
+static size_t		 nmetrics;
+
+static void	 async(FILE *);
+static void	 batch(FILE *);
+static void	 buffered(FILE *);
+static size_t	 buffer(char *, size_t, size_t, void *);
+static void	 cache(FILE *);
+static int	 check(const char *);
+static int	 dblcmp(const void *, const void *);
+static void	*fetchtoken(void *);
+static void	 gotcall(int, struct mix *, void *);
+static void	 gotmix(size_t, struct mix *, void *);
+static void	 gotpage(int, struct mix **, size_t, void *);
+static void	*lookup(void *);
+static double	 now(void);
+static double	 percentile(double *, int, double);
+static void	 play(FILE *);
+static void	 pool(FILE *);
+static void	 query(FILE *);
+static size_t	 received(char *, size_t, size_t, void *);
+static int	 removeentry(const char *, const struct stat *, int,
+		    struct FTW *);
+static void	 retry(FILE *);
+static int	 run(const struct scenario *);
+static void	 search(FILE *);
+static void	 startcall(struct calls *);
+static double	 stream(CURL *, const char *);
+static void	 streamed(FILE *);
+static void	 threads(FILE *);
+static void	 usage(void);
+
+static const struct scenario scenarios[] = {
+	{ "async", async },
+	{ "batch", batch },
+	{ "buffered", buffered },
+	{ "cache", cache },
+	{ "play", play },
+	{ "pool", pool },
+	{ "query", query },
+	{ "retry", retry },
+	{ "search", search },
+	{ "stream", streamed },
+	{ "threads", threads }
+};
+
+/*
+ * Looks up rounds mixes with the asynchronous calls, INFLIGHT of them at a
+ * time, all from this thread: the callbacks are run by client_dispatch in
+ * an event loop and start the next call.  To be compared with the threads
+ * scenario.
+ */
+static void
+async(FILE *out)
+{
+	struct calls c;
+	struct pollfd pfd;
+	double start;
+
+	memset(&c, 0, sizeof(c));
+	if ((c.client = client_new(NULL)) == NULL)
+		err(1, NULL);
+	if ((pfd.fd = client_fd(c.client)) == -1)
+		err(1, "client_fd");
+	pfd.events = POLLIN;
+	start = now();
+	while (c.started < INFLIGHT && c.started < rounds)
+		startcall(&c);
+	while (c.done < c.started)
+		if (poll(&pfd, 1, 1000) > 0)
+			client_dispatch(c.client);
+	if (c.failed > 0)
+		errx(1, "%d calls failed", c.failed);
+	fprintf(out, "async.req_s %f\n", rounds / (now() - start));
+	client_free(c.client);
+}
+
+/*
+ * Looks up rounds mixes one after the other, and then all at once with
+ * JOBS of them in flight, as 8play -Q does with many URLs.  The times are
+ * per mix.
+ */
+static void
+batch(FILE *out)
+{
+	struct mix *mix;
+	const char **urls;
+	char *buf;
+	double start, t;
+	int i, missing = 0;
+
+	if ((urls = calloc(rounds, sizeof(char *))) == NULL ||
+	    (buf = calloc(rounds, 32)) == NULL)
+		err(1, NULL);
+	for (i = 0; i < rounds; ++i) {
+		snprintf(buf + i * 32, 32, "dj/batch-%d", i);
+		urls[i] = buf + i * 32;
+	}
+
+	start = now();
+	for (i = 0; i < rounds; ++i) {
+		if ((mix = mix_getbyurl(urls[i])) == NULL)
+			errx(1, "%s: not found", urls[i]);
+		mix_free(mix);
+	}
+	t = now() - start;
+	fprintf(out, "batch.seq_ms %f\n", t / rounds * 1e3);
+	fprintf(out, "batch.seq_mixes_s %f\n", rounds / t);
+
+	start = now();
+	mix_getbyurls(urls, rounds, JOBS, 0, gotmix, &missing);
+	t = now() - start;
+	if (missing > 0)
+		errx(1, "%d mixes not found", missing);
+	fprintf(out, "batch.ms %f\n", t / rounds * 1e3);
+	fprintf(out, "batch.mixes_s %f\n", rounds / t);
+
+	free(buf);
+	free(urls);
+}
+
+static size_t
+buffer(char *p, size_t size, size_t n, void *arg)
+{
+	struct body *b = arg;
+	char *text;
+
+	n *= size;
+	if ((text = realloc(b->text, b->len + n + 1)) == NULL)
+		return 0;
+	b->text = text;
+	memcpy(b->text + b->len, p, n);
+	b->len += n;
+	b->text[b->len] = '\0';
+	return n;
+}
+
+/*
+ * Fetches a search page of BIGPAGE mixes, as was done before responses
+ * were parsed while they arrive: the body is grown with every chunk
+ * received and then parsed in one go.  To be compared with the stream
+ * scenario, which also builds the mix records.
+ */
+static void
+buffered(FILE *out)
+{
+	struct body b;
+	struct json_object *root;
+	CURL *curl;
+	char url[256];
+	double start;
+	int i;
+
+	snprintf(url, sizeof(url), "%smix_sets/%s?include=mixes[user]+"
+	    "pagination&page=1&per_page=%d", server, SMARTID, BIGPAGE);
+	if ((curl = curl_easy_init()) == NULL)
+		errx(1, "curl_easy_init failed");
+	start = now();
+	for (i = 0; i < BIGROUNDS; ++i) {
+		memset(&b, 0, sizeof(b));
+		if (curl_easy_setopt(curl, CURLOPT_URL, url) != CURLE_OK ||
+		    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, buffer) !=
+		    CURLE_OK ||
+		    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &b) != CURLE_OK ||
+		    curl_easy_perform(curl) != CURLE_OK ||
+		    (root = json_tokener_parse(b.text)) == NULL)
+			errx(1, "%s: fetch failed", url);
+		json_object_put(root);
+		free(b.text);
+	}
+	fprintf(out, "buffered.ms %f\n", (now() - start) / BIGROUNDS * 1e3);
+	curl_easy_cleanup(curl);
+}
+
+/*
+ * Fetches a different mix every round through curl_fetchcached, three
+ * times over.  The cache is empty at first and the responses are stored
+ * as expired, so the second time they are revalidated and the server
+ * answers 304 Not Modified.  The third time they are answered from the
+ * cache.  The cache is made in a directory of its own, which is removed
+ * afterwards.
+ */
+static void
+cache(FILE *out)
+{
+	static const struct {
+		const char	*name;
+		long		 ttl;
+	} pass[] = {
+		{ "cold", 0 },
+		{ "revalidate", 3600 },
+		{ "hit", 3600 }
+	};
+	struct curlstats before, after;
+	struct json_object *root;
+	char dir[] = "/tmp/e2e.XXXXXX", url[256];
+	double start;
+	size_t p;
+	int i;
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	if (setenv("XDG_CACHE_HOME", dir, 1) == -1)
+		err(1, "setenv");
+	cache_init();
+	for (p = 0; p < sizeof(pass) / sizeof(pass[0]); ++p) {
+		curl_getstats(&before);
+		start = now();
+		for (i = 0; i < rounds; ++i) {
+			snprintf(url, sizeof(url), "%sdj/mix-%d.json", server,
+			    i);
+			if ((root = curl_fetchcached(url, pass[p].ttl)) == NULL)
+				errx(1, "%s: fetch failed", url);
+			json_object_put(root);
+		}
+		fprintf(out, "cache.%s_ms %f\n", pass[p].name,
+		    (now() - start) / rounds * 1e3);
+		/* only hits are answered without asking the server */
+		curl_getstats(&after);
+		if ((after.requests == before.requests) != (p == 2))
+			errx(1, "%s: %lu requests", pass[p].name,
+			    after.requests - before.requests);
+	}
+	cache_exit();
+	if (nftw(dir, removeentry, 8, FTW_DEPTH | FTW_PHYS) == -1)
+		warn("%s", dir);
+}
+
+/*
+ * Checks the metrics against the limits in the file at path.  Returns the
+ * number of limits crossed, counting a metric that was not measured as
+ * one.
+ */
+static int
+check(const char *path)
+{
+	FILE *fp;
+	char line[256], name[64], op[2];
+	double limit;
+	size_t i;
+	int bad = 0, n;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#' || line[strspn(line, " \t\n")] == '\0')
+			continue;
+		if (sscanf(line, "%63s %1[<>] %lf", name, op, &limit) != 3)
+			errx(1, "%s: bad line: %s", path, line);
+		for (i = 0; i < nmetrics; ++i)
+			if (strcmp(metrics[i].name, name) == 0)
+				break;
+		if (i == nmetrics) {
+			printf("%-24s not measured\n", name);
+			bad++;
+			continue;
+		}
+		n = op[0] == '<' ? metrics[i].value < limit :
+		    metrics[i].value > limit;
+		printf("%-24s %12.2f %s %-10g %s\n", name, metrics[i].value,
+		    op, limit, n ? "ok" : "REGRESSION");
+		bad += !n;
+	}
+	fclose(fp);
+	return bad;
+}
+
+static int
+dblcmp(const void *a, const void *b)
+{
+	const double *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+static void *
+fetchtoken(void *arg)
+{
+	(void)arg;
+	return getplaytoken();
+}
+
+static void
+gotcall(int error, struct mix *mix, void *arg)
+{
+	struct calls *c = arg;
+
+	c->done++;
+	if (error != CLIENT_OK)
+		c->failed++;
+	mix_free(mix);
+	if (c->started < rounds)
+		startcall(c);
+}
+
+static void
+gotmix(size_t i, struct mix *mix, void *arg)
+{
+	int *missing = arg;
+
+	(void)i;
+	if (mix == NULL)
+		(*missing)++;
+	mix_free(mix);
+}
+
+static void
+gotpage(int page, struct mix **mixes, size_t size, void *arg)
+{
+	int *missing = arg;
+
+	(void)page;
+	if (mixes == NULL)
+		(*missing)++;
+	mixset_free(&mixes, size);
+}
+
+/*
+ * Looks up the mix numbered *arg with the blocking call.
+ */
+static void *
+lookup(void *arg)
+{
+	char url[32];
+
+	snprintf(url, sizeof(url), "dj/threads-%d", *(int *)arg);
+	return mix_getbyurl(url);
+}
+
+/*
+ * Returns the seconds since some point in the past.
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Returns the pth percentile of the n values in v, which are sorted.
+ */
+static double
+percentile(double *v, int n, double p)
+{
+	qsort(v, n, sizeof(double), dblcmp);
+	return v[(int)(p / 100 * (n - 1) + 0.5)];
+}
+
+/*
+ * Plays a mix as the player does: the play token and the mix are looked
+ * up at the same time, and then every track is streamed, reported and
+ * followed by the next.  The time to the first audio is the time to the
+ * first byte of the first stream, the gap the time from the end of one
+ * stream to the first byte of the next.
+ */
+static void
+play(FILE *out)
+{
+	struct curlstats stats;
+	struct mix *mix;
+	struct track *track;
+	pthread_t thread;
+	CURL *curl;
+	char *token;
+	double first, gap = 0, start, t;
+	int i;
+
+	if ((curl = curl_easy_init()) == NULL)
+		errx(1, "curl_easy_init failed");
+	start = now();
+	if (pthread_create(&thread, NULL, fetchtoken, NULL) != 0)
+		errx(1, "pthread_create failed");
+	mix = mix_getbyurl("dj/mix");
+	pthread_join(thread, (void **)&token);
+	if (mix == NULL || token == NULL)
+		errx(1, "no mix or play token");
+	if ((track = track_getfirst(mix->id, token)) == NULL)
+		errx(1, "no first track");
+	first = stream(curl, track->url) - start;
+	for (i = 1; i < rounds; ++i) {
+		if (report(track->id, mix->id, token) != 0)
+			errx(1, "report of track %d failed", track->id);
+		track_free(track);
+		t = now();
+		if ((track = track_getnext(mix->id, token)) == NULL)
+			errx(1, "no next track");
+		gap += stream(curl, track->url) - t;
+	}
+	t = now() - start;
+	curl_getstats(&stats);
+	fprintf(out, "play.firstaudio_ms %f\n", first * 1e3);
+	fprintf(out, "play.gap_ms %f\n", rounds > 1 ? gap / (rounds - 1) * 1e3 :
+	    0);
+	fprintf(out, "play.req_s %f\n", (stats.requests + rounds) / t);
+	track_free(track);
+	mix_free(mix);
+	free(token);
+	curl_easy_cleanup(curl);
+}
+
+/*
+ * Fetches a different mix every round, through curl_fetch, which reuses
+ * the handles and connections of its pool, and then with an easy handle of
+ * its own for every request, which sets up a connection every time.
+ */
+static void
+pool(FILE *out)
+{
+	struct stream s;
+	struct json_object *root;
+	CURL *curl;
+	double *latency, start, t;
+	char url[256];
+	int i;
+
+	if ((latency = calloc(rounds, sizeof(double))) == NULL)
+		err(1, NULL);
+	start = now();
+	for (i = 0; i < rounds; ++i) {
+		snprintf(url, sizeof(url), "%sdj/mix-%d.json", server, i);
+		t = now();
+		if ((root = curl_fetch(url, NULL)) == NULL)
+			errx(1, "%s: fetch failed", url);
+		latency[i] = now() - t;
+		json_object_put(root);
+	}
+	t = now() - start;
+	fprintf(out, "pool.req_s %f\n", rounds / t);
+	fprintf(out, "pool.p50_ms %f\n", percentile(latency, rounds, 50) * 1e3);
+	fprintf(out, "pool.p99_ms %f\n", percentile(latency, rounds, 99) * 1e3);
+
+	start = now();
+	for (i = 0; i < rounds; ++i) {
+		snprintf(url, sizeof(url), "%sdj/mix-%d.json", server, i);
+		memset(&s, 0, sizeof(s));
+		t = now();
+		if ((curl = curl_easy_init()) == NULL ||
+		    curl_easy_setopt(curl, CURLOPT_URL, url) != CURLE_OK ||
+		    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, received) !=
+		    CURLE_OK ||
+		    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &s) != CURLE_OK ||
+		    curl_easy_perform(curl) != CURLE_OK)
+			errx(1, "%s: fetch failed", url);
+		curl_easy_cleanup(curl);
+		latency[i] = now() - t;
+	}
+	t = now() - start;
+	fprintf(out, "pool.fresh_req_s %f\n", rounds / t);
+	fprintf(out, "pool.fresh_p50_ms %f\n",
+	    percentile(latency, rounds, 50) * 1e3);
+	fprintf(out, "pool.fresh_p99_ms %f\n",
+	    percentile(latency, rounds, 99) * 1e3);
+	free(latency);
+}
+
+/*
+ * Looks up a different mix every round.
+ */
+static void
+query(FILE *out)
+{
+	struct mix *mix;
+	char url[32];
+	double start, t;
+	int i;
+
+	start = now();
+	for (i = 0; i < rounds; ++i) {
+		snprintf(url, sizeof(url), "dj/mix-%d", i);
+		if ((mix = mix_getbyurl(url)) == NULL)
+			errx(1, "%s: not found", url);
+		mix_free(mix);
+	}
+	t = now() - start;
+	fprintf(out, "query.ms %f\n", t / rounds * 1e3);
+	fprintf(out, "query.req_s %f\n", rounds / t);
+}
+
+static size_t
+received(char *p, size_t size, size_t n, void *arg)
+{
+	struct stream *s = arg;
+
+	(void)p;
+	if (s->bytes == 0)
+		s->first = now();
+	s->bytes += size * n;
+	return size * n;
+}
+
+static int
+removeentry(const char *path, const struct stat *sb, int flag,
+    struct FTW *ftw)
+{
+	(void)sb;
+	(void)flag;
+	(void)ftw;
+	if (remove(path) == -1)
+		warn("%s", path);
+	return 0;
+}
+
+/*
+ * Looks up mixes on a flaky path of the server, where every other request
+ * is refused or has its connection dropped, so that every lookup succeeds
+ * only when tried again.  Then saves a track stream that is cut off
+ * halfway, which is resumed with a range request, and one that is not.
+ */
+static void
+retry(FILE *out)
+{
+	struct curlstats before, after;
+	struct mix *mix;
+	FILE *fp;
+	char url[256];
+	double start, t;
+	long size;
+	int i;
+
+	curl_getstats(&before);
+	start = now();
+	for (i = 0; i < RETRYROUNDS; ++i) {
+		snprintf(url, sizeof(url), "flaky/dj/mix-%d", i);
+		if ((mix = mix_getbyurl(url)) == NULL)
+			errx(1, "%s: not found", url);
+		mix_free(mix);
+	}
+	t = now() - start;
+	curl_getstats(&after);
+	fprintf(out, "retry.recovery_ms %f\n", t / RETRYROUNDS * 1e3);
+	fprintf(out, "retry.retries %lu\n", after.retries - before.retries);
+	fprintf(out, "retry.failed %lu\n", after.failed - before.failed);
+
+	snprintf(url, sizeof(url), "%saudio/1", server);
+	if ((fp = tmpfile()) == NULL)
+		err(1, "tmpfile");
+	start = now();
+	if (curl_save(url, fp, NULL, NULL) == -1 || (size = ftell(fp)) <= 0)
+		errx(1, "%s: save failed", url);
+	fprintf(out, "retry.save_ms %f\n", (now() - start) * 1e3);
+	fclose(fp);
+
+	snprintf(url, sizeof(url), "%sflaky/audio/1", server);
+	if ((fp = tmpfile()) == NULL)
+		err(1, "tmpfile");
+	start = now();
+	if (curl_save(url, fp, NULL, NULL) == -1)
+		errx(1, "%s: save failed", url);
+	fprintf(out, "retry.resume_ms %f\n", (now() - start) * 1e3);
+	if (ftell(fp) != size)
+		errx(1, "%s: %ld bytes saved, not %ld", url, ftell(fp), size);
+	fclose(fp);
+}
+
+/*
+ * Runs a scenario in a child process and adds what it measured to the
+ * metrics.  Returns -1 if the scenario failed.
+ */
+static int
+run(const struct scenario *sc)
+{
+	struct rusage ru;
+	FILE *fp;
+	char line[128], name[64];
+	double value;
+	pid_t pid;
+	int fd[2], status;
+
+	fflush(stdout);
+	if (pipe(fd) == -1)
+		err(1, "pipe");
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		close(fd[0]);
+		if ((fp = fdopen(fd[1], "w")) == NULL)
+			err(1, "fdopen");
+		curl_init();
+		sc->run(fp);
+		curl_exit();
+		getrusage(RUSAGE_SELF, &ru);
+		fprintf(fp, "%s.rss_kb %ld\n", sc->name, ru.ru_maxrss);
+		exit(fclose(fp) != 0);
+	}
+
+	close(fd[1]);
+	if ((fp = fdopen(fd[0], "r")) == NULL)
+		err(1, "fdopen");
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%63s %lf", name, &value) != 2)
+			continue;
+		if (nmetrics == METRICMAX)
+			errx(1, "too many metrics");
+		snprintf(metrics[nmetrics].name, sizeof(metrics[0].name),
+		    "%s", name);
+		metrics[nmetrics++].value = value;
+	}
+	fclose(fp);
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		warnx("%s failed", sc->name);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Searches the first page of a mix set every round, and then ten pages
+ * at once.
+ */
+static void
+search(FILE *out)
+{
+	struct mix **mixes;
+	size_t size;
+	double start, t;
+	int i, missing = 0;
+
+	start = now();
+	for (i = 0; i < rounds; ++i) {
+		if ((mixes = mixset_searchbysmartid(SMARTID, 1, 12,
+		    &size)) == NULL)
+			errx(1, "%s: not found", SMARTID);
+		mixset_free(&mixes, size);
+	}
+	t = now() - start;
+	fprintf(out, "search.ms %f\n", t / rounds * 1e3);
+	fprintf(out, "search.req_s %f\n", rounds / t);
+
+	start = now();
+	if (mixset_searchpages(SMARTID, 1, 10, 12, 4, gotpage,
+	    &missing) != 10 || missing > 0)
+		errx(1, "%s: pages not found", SMARTID);
+	fprintf(out, "search.pages_ms %f\n", (now() - start) * 1e3);
+}
+
+static void
+startcall(struct calls *c)
+{
+	char url[32];
+
+	snprintf(url, sizeof(url), "dj/async-%d", c->started++);
+	if (client_getmixasync(c->client, url, gotcall, c) != CLIENT_OK) {
+		c->done++;
+		c->failed++;
+	}
+}
+
+/*
+ * Searches a page of BIGPAGE mixes, which is parsed while it arrives.
+ */
+static void
+streamed(FILE *out)
+{
+	struct mix **mixes;
+	size_t size;
+	double start;
+	int i;
+
+	start = now();
+	for (i = 0; i < BIGROUNDS; ++i) {
+		if ((mixes = mixset_searchbysmartid(SMARTID, 1, BIGPAGE,
+		    &size)) == NULL || size != BIGPAGE)
+			errx(1, "%s: not found", SMARTID);
+		mixset_free(&mixes, size);
+	}
+	fprintf(out, "stream.ms %f\n", (now() - start) / BIGROUNDS * 1e3);
+}
+
+/*
+ * Receives the stream at url and returns when its first byte came in.
+ */
+static double
+stream(CURL *curl, const char *url)
+{
+	struct stream s;
+
+	memset(&s, 0, sizeof(s));
+	if (curl_easy_setopt(curl, CURLOPT_URL, url) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, received) !=
+	    CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &s) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L) != CURLE_OK ||
+	    curl_easy_perform(curl) != CURLE_OK || s.bytes == 0)
+		errx(1, "%s: stream failed", url);
+	return s.first;
+}
+
+/*
+ * Looks up rounds mixes with the blocking calls, a thread for every call,
+ * INFLIGHT of them at a time.
+ */
+static void
+threads(FILE *out)
+{
+	pthread_t thread[INFLIGHT];
+	void *mix;
+	double start;
+	int i, id[INFLIGHT], j, n;
+
+	start = now();
+	for (i = 0; i < rounds; i += n) {
+		n = rounds - i < INFLIGHT ? rounds - i : INFLIGHT;
+		for (j = 0; j < n; ++j) {
+			id[j] = i + j;
+			if (pthread_create(&thread[j], NULL, lookup, &id[j]) != 0)
+				errx(1, "pthread_create failed");
+		}
+		for (j = 0; j < n; ++j) {
+			pthread_join(thread[j], &mix);
+			if (mix == NULL)
+				errx(1, "mix %d not found", id[j]);
+			mix_free(mix);
+		}
+	}
+	fprintf(out, "threads.req_s %f\n", rounds / (now() - start));
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n rounds] [baseline]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t i;
+	int bad = 0, ch;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			if ((rounds = atoi(optarg)) <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		usage();
+	if ((server = getenv("EIGHTPLAY_SERVER")) == NULL)
+		errx(1, "EIGHTPLAY_SERVER is not set; run me under bench/server");
+
+	for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i)
+		if (run(&scenarios[i]) == -1)
+			bad++;
+	if (argc == 1)
+		bad += check(argv[0]);
+	else
+		for (i = 0; i < nmetrics; ++i)
+			printf("%-24s %12.2f\n", metrics[i].name,
+			    metrics[i].value);
+	return bad > 0;
+}
@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2015 Johannes Postma <jgmpostma@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark of what is done with an API response.  It is linked against
+ * 8tracks.c with the transport of curl.c replaced: a request is answered
+ * right away with a response from the corpus, parsed once up front, so
+ * that what is timed is the status check and the building of the mix, mix
+ * set and track records.  Parsing the JSON is timed on its own, both in
+ * one go and in chunks the size of a TCP segment, as curl.c parses a
+ * response while it arrives.  Besides the recorded responses, generated
+ * mix set pages of 100, 1000 and 10000 mixes are used.
+ *
+ * Every figure is given per record, a mix or a track, together with the
+ * allocations made and the bytes asked for.  These are counted by wrapping
+ * malloc, calloc and realloc, which json-c and libc call through the
+ * dynamic linker as well.
+ */
+#define _GNU_SOURCE		/* RTLD_NEXT */
+
+#include <dlfcn.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <json.h>
+
+#include "8tracks.h"
+#include "corpus.h"
+#include "curl.h"
+
+#define ITERATIONS	20000
+#define CHUNK		1448	/* bytes in a TCP segment */
+#define MINITERATIONS	10
+
+enum {
+	MIX,
+	MIXSET,
+	REPORT,
+	SIMILAR,
+	TOKEN,
+	TRACK,
+	PAGE100,
+	PAGE1000,
+	PAGE10000,
+	NRESPONSES
+};
+
+struct response {
+	const char		*file;
+	size_t			 mixes;		/* generated page, if not 0 */
+	char			*text;
+	size_t			 len;
+	size_t			 records;	/* mixes or tracks in it */
+	struct json_object	*root;
+};
+
+/* what was used since the start of a benchmark */
+struct sample {
+	struct timespec		 start;
+	unsigned long		 allocs;
+	unsigned long long	 bytes;
+};
+
+extern char		*__progname;
+static struct response	 responses[NRESPONSES] = {
+	{ "mix.json", 0, NULL, 0, 0, NULL },
+	{ "mixset.json", 0, NULL, 0, 0, NULL },
+	{ "report.json", 0, NULL, 0, 0, NULL },
+	{ "similar.json", 0, NULL, 0, 0, NULL },
+	{ "token.json", 0, NULL, 0, 0, NULL },
+	{ "track.json", 0, NULL, 0, 0, NULL },
+	{ "mixset100", 100, NULL, 0, 0, NULL },
+	{ "mixset1000", 1000, NULL, 0, 0, NULL },
+	{ "mixset10000", 10000, NULL, 0, 0, NULL }
+};
+static void		*(*nextcalloc)(size_t, size_t);
+static void		 (*nextfree)(void *);
+static void		*(*nextmalloc)(size_t);
+static void		*(*nextrealloc)(void *, size_t);
+static unsigned long	 allocs;
+static unsigned long long allocbytes;
+static char		 early[4096];	/* for dlsym, before calloc is known */
+static size_t		 earlyused;
+
+static void		 begin(struct sample *);
+static long		 iterations(const struct response *, long);
+static void		 load(const char *, struct response *);
+static struct json_object *lookup(const char *);
+static void		 parse(struct response *, long);
+static void		 parsechunked(struct response *, long);
+static void		 resolve(void);
+static void		 result(const char *, const struct sample *, long,
+			    size_t, size_t);
+static void		 usage(void);
+
+void *
+calloc(size_t n, size_t size)
+{
+	void *p;
+
+	if (nextcalloc == NULL) {
+		/* dlsym may allocate while calloc is being looked up */
+		if (n != 0 && size > (sizeof(early) - earlyused) / n)
+			return NULL;
+		p = early + earlyused;
+		earlyused += (n * size + 15) & ~(size_t)15;
+		return p;
+	}
+	allocs++;
+	allocbytes += n * size;
+	return nextcalloc(n, size);
+}
+
+void
+free(void *p)
+{
+	if ((char *)p >= early && (char *)p < early + sizeof(early))
+		return;
+	if (nextfree == NULL)
+		resolve();
+	nextfree(p);
+}
+
+void *
+malloc(size_t size)
+{
+	if (nextmalloc == NULL)
+		resolve();
+	allocs++;
+	allocbytes += size;
+	return nextmalloc(size);
+}
+
+void *
+realloc(void *p, size_t size)
+{
+	if (nextrealloc == NULL)
+		resolve();
+	allocs++;
+	allocbytes += size;
+	return nextrealloc(p, size);
+}
+
+/*
+ * The transport.  Every request is answered with a new reference to the
+ * response from the corpus that fits its URL.
+ */
+int
+curl_fetchasync(const char *url, const char *post, long ttl,
+    void (*cb)(struct json_object *, long, void *), void *arg)
+{
+	(void)post;
+	(void)ttl;
+	cb(json_object_get(lookup(url)), 200, arg);
+	return 0;
+}
+
+struct json_object *
+curl_fetchcached(const char *url, long ttl)
+{
+	(void)ttl;
+	return json_object_get(lookup(url));
+}
+
+void
+curl_fetchmany(const char **urls, size_t n, int maxconn, int ordered,
+    long ttl, void (*cb)(size_t, struct json_object *, void *), void *arg)
+{
+	size_t i;
+
+	(void)maxconn;
+	(void)ordered;
+	(void)ttl;
+	for (i = 0; i < n; ++i)
+		cb(i, json_object_get(lookup(urls[i])), arg);
+}
+
+static void
+begin(struct sample *s)
+{
+	s->allocs = allocs;
+	s->bytes = allocbytes;
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+}
+
+/*
+ * Returns how often r is to be handled, so that every benchmark handles
+ * about as many records as n times a single one.
+ */
+static long
+iterations(const struct response *r, long n)
+{
+	n /= (long)r->records;
+	return n < MINITERATIONS ? MINITERATIONS : n;
+}
+
+static void
+load(const char *dir, struct response *r)
+{
+	struct json_object *set, *mixes;
+
+	if (r->mixes > 0)
+		r->text = corpus_mixset(dir, r->mixes, &r->len);
+	else
+		r->text = corpus_load(dir, r->file, &r->len);
+	if ((r->root = json_tokener_parse(r->text)) == NULL)
+		errx(1, "%s: not valid JSON", r->file);
+	r->records = 1;
+	if (json_object_object_get_ex(r->root, "mix_set", &set) &&
+	    json_object_object_get_ex(set, "mixes", &mixes) &&
+	    json_object_array_length(mixes) > 0)
+		r->records = json_object_array_length(mixes);
+}
+
+/*
+ * Returns the response for url, as 8tracks.c builds its URLs.  A mix set
+ * page is the generated one of its size, if there is one.
+ */
+static struct json_object *
+lookup(const char *url)
+{
+	const char *s;
+	size_t i, pp;
+
+	if (strstr(url, "mix_sets/") != NULL) {
+		if ((s = strstr(url, "per_page=")) != NULL) {
+			pp = strtoul(s + strlen("per_page="), NULL, 10);
+			for (i = 0; i < NRESPONSES; ++i)
+				if (responses[i].mixes == pp)
+					return responses[i].root;
+		}
+		return responses[MIXSET].root;
+	}
+	if (strstr(url, "sets/new") != NULL)
+		return responses[TOKEN].root;
+	if (strstr(url, "/report?") != NULL)
+		return responses[REPORT].root;
+	if (strstr(url, "/next_mix?") != NULL)
+		return responses[SIMILAR].root;
+	if (strstr(url, "sets/") != NULL)
+		return responses[TRACK].root;
+	return responses[MIX].root;
+}
+
+static void
+parse(struct response *r, long n)
+{
+	struct sample s;
+	char name[32];
+	long i;
+
+	n = iterations(r, n);
+	begin(&s);
+	for (i = 0; i < n; ++i)
+		json_object_put(json_tokener_parse(r->text));
+	snprintf(name, sizeof(name), "parse %s", r->file);
+	result(name, &s, n, r->records, r->len);
+}
+
+static void
+parsechunked(struct response *r, long n)
+{
+	struct sample s;
+	json_tokener *tok;
+	json_object *root;
+	char name[32];
+	size_t len, off;
+	long i;
+
+	if ((tok = json_tokener_new()) == NULL)
+		err(1, NULL);
+	n = iterations(r, n);
+	begin(&s);
+	for (i = 0; i < n; ++i) {
+		root = NULL;
+		for (off = 0; off < r->len; off += len) {
+			len = r->len - off < CHUNK ? r->len - off : CHUNK;
+			root = json_tokener_parse_ex(tok, r->text + off,
+			    (int)len);
+			if (json_tokener_get_error(tok) != json_tokener_continue)
+				break;
+		}
+		if (root == NULL)
+			errx(1, "%s: not valid JSON", r->file);
+		json_object_put(root);
+		json_tokener_reset(tok);
+	}
+	snprintf(name, sizeof(name), "chunked %s", r->file);
+	result(name, &s, n, r->records, r->len);
+	json_tokener_free(tok);
+}
+
+/*
+ * Looks up the allocator of libc.  calloc goes last, as dlsym may call it.
+ */
+static void
+resolve(void)
+{
+	*(void **)&nextfree = dlsym(RTLD_NEXT, "free");
+	*(void **)&nextmalloc = dlsym(RTLD_NEXT, "malloc");
+	*(void **)&nextrealloc = dlsym(RTLD_NEXT, "realloc");
+	*(void **)&nextcalloc = dlsym(RTLD_NEXT, "calloc");
+	if (nextfree == NULL || nextmalloc == NULL || nextrealloc == NULL ||
+	    nextcalloc == NULL)
+		abort();
+}
+
+/*
+ * Prints what n runs of a benchmark of records records each took since s,
+ * and the throughput if bytes of JSON were parsed every run.
+ */
+static void
+result(const char *name, const struct sample *s, long n, size_t records,
+    size_t bytes)
+{
+	struct timespec now;
+	double ns, total;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - s->start.tv_sec) * 1e9 +
+	    (now.tv_nsec - s->start.tv_nsec);
+	total = (double)n * records;
+	printf("%-24s %10.0f ns/record %8.2f allocs/record %9.0f B/record",
+	    name, ns / total, (allocs - s->allocs) / total,
+	    (allocbytes - s->bytes) / total);
+	if (bytes > 0)
+		printf(" %8.1f MB/s", bytes * n / (ns / 1e9) / 1e6);
+	printf("\n");
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [corpus]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sample smp;
+	struct client *c;
+	struct session *s;
+	struct mix *mix, **mixes;
+	struct track *track;
+	const char *dir = "bench/corpus";
+	char name[32];
+	size_t i, size;
+	long j, k, n = ITERATIONS;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			if ((n = atol(optarg)) <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		usage();
+	if (argc == 1)
+		dir = argv[0];
+
+	for (i = 0; i < NRESPONSES; ++i)
+		load(dir, &responses[i]);
+	if ((c = client_new("http://localhost/")) == NULL ||
+	    session_new(c, "735463528", &s) != CLIENT_OK)
+		errx(1, "out of memory");
+
+	for (i = 0; i < NRESPONSES; ++i) {
+		parse(&responses[i], n);
+		parsechunked(&responses[i], n);
+	}
+
+	begin(&smp);
+	for (j = 0; j < n; ++j) {
+		if (client_getmix(c, "dj1/mix-1", &mix) != CLIENT_OK)
+			errx(1, "mix: not found");
+		mix_free(mix);
+	}
+	result("mix", &smp, n, 1, 0);
+
+	/* the recorded page and the generated ones */
+	for (i = MIXSET; i < NRESPONSES; ++i) {
+		if (i != MIXSET && responses[i].mixes == 0)
+			continue;
+		k = iterations(&responses[i], n);
+		begin(&smp);
+		for (j = 0; j < k; ++j) {
+			if (client_search(c, "tags:chill:popular", 1,
+			    (int)responses[i].mixes, &mixes, &size) !=
+			    CLIENT_OK)
+				errx(1, "%s: not found", responses[i].file);
+			mixset_free(&mixes, size);
+		}
+		snprintf(name, sizeof(name), "search %s", responses[i].file);
+		result(name, &smp, k, responses[i].records, 0);
+	}
+
+	begin(&smp);
+	for (j = 0; j < n; ++j) {
+		if (session_getsimilar(s, &mix) != CLIENT_OK)
+			errx(1, "similar: not found");
+		mix_free(mix);
+	}
+	result("similar", &smp, n, 1, 0);
+
+	begin(&smp);
+	for (j = 0; j < n; ++j) {
+		if (session_next(s, &track) != CLIENT_OK)
+			errx(1, "track: not found");
+		track_free(track);
+	}
+	result("track", &smp, n, 1, 0);
+
+	begin(&smp);
+	for (j = 0; j < n; ++j)
+		if (session_report(s, 26301957) != CLIENT_OK)
+			errx(1, "report: refused");
+	result("report", &smp, n, 1, 0);
+
+	session_free(s);
+	client_free(c);
+	for (i = 0; i < NRESPONSES; ++i) {
+		json_object_put(responses[i].root);
+		free(responses[i].text);
+	}
+	return 0;
+}
@@ -0,0 +1,577 @@
+/*
+ * Copyright (c) 2015 Johannes Postma <jgmpostma@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A stand-in for the 8tracks API and for the servers the tracks are
+ * streamed from, so that the benchmarks never reach the real service.  It
+ * answers HTTP/1.1 requests on the loopback interface with the responses
+ * of the corpus: a play token, mixes, tracks with stream URLs that point
+ * back at it, reports, and mix set pages of as many mixes as are asked
+ * for.  Streams are served from memory, ranges included.  Paths that begin
+ * with flaky/ are served badly: every other request is refused with a 503
+ * or has its connection dropped, and streams break off halfway.  Given a
+ * command, the server runs it with EIGHTPLAY_SERVER set to its own address
+ * and exits with the command's exit status.  There is no TLS.
+ */
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <json.h>
+
+#include "corpus.h"
+
+#define AUDIOSIZE	(256 * 1024)	/* bytes in a track */
+#define HEADERMAX	8192		/* longest request head */
+#define PAGEMAX		10000		/* most mixes on a page */
+#define PAGES		8		/* pages kept once made */
+#define UNAVAILABLE	"{\"status\":\"503 Service Unavailable\"}"
+
+enum {
+	MIX,
+	REPORT,
+	SIMILAR,
+	TOKEN,
+	TRACK,
+	NRESPONSES
+};
+
+struct response {
+	const char	*file;
+	char		*text;
+	size_t		 len;
+	char		 etag[16];
+	size_t		 mixes;		/* on a generated page */
+};
+
+/* a request as far as the server cares */
+struct request {
+	char	*path;		/* without the leading slash */
+	char	*query;
+	int	 flaky;
+	int	 close;		/* Connection: close */
+	int	 cut;		/* the body breaks off halfway */
+	long	 range;		/* first byte asked for, or -1 */
+	size_t	 length;	/* of the body */
+	char	 etag[16];	/* If-None-Match */
+};
+
+extern char		*__progname;
+static const char	*dir;
+static char		 base[64];
+static char		*audio;
+static struct response	 responses[NRESPONSES] = {
+	{ "mix.json", NULL, 0, "", 0 },
+	{ "report.json", NULL, 0, "", 0 },
+	{ "similar.json", NULL, 0, "", 0 },
+	{ "token.json", NULL, 0, "", 0 },
+	{ "track.json", NULL, 0, "", 0 }
+};
+static struct response	 pages[PAGES];
+static size_t		 npages;
+static unsigned long	 nflaky;	/* requests to flaky/ paths */
+static int		 trackid;
+static pthread_mutex_t	 lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void	 answer(int, const struct request *, int, const char *,
+		    const char *, const char *, size_t, const char *);
+static void	 etag(struct response *);
+static int	 fault(const struct request *);
+static int	 handle(int, struct request *);
+static void	*listener(void *);
+static const struct response *page(size_t, struct response *);
+static int	 parse(char *, struct request *);
+static int	 sendall(int, const char *, size_t, const char *, size_t);
+static void	*serve(void *);
+static void	 serveaudio(int, struct request *);
+static void	 servejson(int, const struct request *,
+		    const struct response *);
+static void	 servetrack(int, const struct request *);
+static void	 usage(void);
+
+/*
+ * Sends a response.  extra holds additional header lines, each ending in
+ * CRLF.  The head and the body go out in one write where possible.
+ */
+static void
+answer(int fd, const struct request *r, int code, const char *reason,
+    const char *type, const char *extra, size_t len, const char *body)
+{
+	char head[512];
+	int n;
+
+	n = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\n"
+	    "Content-Type: %s\r\n"
+	    "Content-Length: %zu\r\n"
+	    "%s%s\r\n", code, reason, type, len, extra,
+	    r->close ? "Connection: close\r\n" : "");
+	if (n < 0 || (size_t)n >= sizeof(head))
+		return;
+	if (code == 304)
+		len = 0;
+	else if (r->cut)
+		len /= 2;
+	sendall(fd, head, n, body, len);
+}
+
+/*
+ * Sets the entity tag of a response, an FNV-1a hash of its text.
+ */
+static void
+etag(struct response *r)
+{
+	unsigned long h = 2166136261UL;
+	size_t i;
+
+	for (i = 0; i < r->len; ++i)
+		h = ((h ^ (unsigned char)r->text[i]) * 16777619UL) &
+		    0xffffffffUL;
+	snprintf(r->etag, sizeof(r->etag), "\"%08lx\"", h);
+}
+
+/*
+ * Returns how a request to a flaky path goes wrong: 0 if it is served, 1
+ * if it is refused and 2 if its connection is dropped.  Every other
+ * request goes wrong, the two ways in turn, so that a request tried again
+ * once gets through.
+ */
+static int
+fault(const struct request *r)
+{
+	unsigned long n;
+
+	if (!r->flaky)
+		return 0;
+	pthread_mutex_lock(&lock);
+	n = ++nflaky;
+	pthread_mutex_unlock(&lock);
+	if (n % 2 == 0)
+		return 0;
+	return n % 4 == 1 ? 1 : 2;
+}
+
+/*
+ * Answers a request.  Returns -1 if the connection is to be closed.
+ */
+static int
+handle(int fd, struct request *r)
+{
+	struct response tmp;
+	const struct response *p;
+	const char *s;
+	long n;
+
+	if (strncmp(r->path, "audio/", 6) == 0) {
+		serveaudio(fd, r);
+		return r->cut ? -1 : 0;
+	}
+	switch (fault(r)) {
+	case 1:
+		answer(fd, r, 503, "Service Unavailable", "application/json",
+		    "Retry-After: 0\r\n", strlen(UNAVAILABLE), UNAVAILABLE);
+		return 0;
+	case 2:
+		return -1;
+	}
+
+	if (strncmp(r->path, "mix_sets/", 9) == 0) {
+		n = 12;
+		if (r->query != NULL &&
+		    (s = strstr(r->query, "per_page=")) != NULL)
+			n = strtol(s + 9, NULL, 10);
+		if (n <= 0 || n > PAGEMAX)
+			n = n <= 0 ? 12 : PAGEMAX;
+		memset(&tmp, 0, sizeof(tmp));
+		p = page((size_t)n, &tmp);
+		servejson(fd, r, p);
+		free(tmp.text);
+		return 0;
+	} else if (strcmp(r->path, "sets/new") == 0)
+		p = &responses[TOKEN];
+	else if (strncmp(r->path, "sets/", 5) == 0) {
+		if ((s = strrchr(r->path, '/')) != NULL &&
+		    strcmp(s, "/report") == 0)
+			p = &responses[REPORT];
+		else if (s != NULL && strcmp(s, "/next_mix") == 0)
+			p = &responses[SIMILAR];
+		else {
+			servetrack(fd, r);
+			return 0;
+		}
+	} else
+		p = &responses[MIX];
+	servejson(fd, r, p);
+	return 0;
+}
+
+/*
+ * Accepts connections on the socket fd and serves each on a thread of its
+ * own.
+ */
+static void *
+listener(void *arg)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int fd = *(int *)arg, *cfd, on = 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (;;) {
+		if ((cfd = malloc(sizeof(int))) == NULL)
+			err(1, NULL);
+		while ((*cfd = accept(fd, NULL, NULL)) == -1)
+			if (errno != EINTR && errno != ECONNABORTED)
+				err(1, "accept");
+		setsockopt(*cfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		if (pthread_create(&thread, &attr, serve, cfd) != 0)
+			errx(1, "pthread_create failed");
+	}
+	return NULL;
+}
+
+/*
+ * Returns the mix set page of n mixes.  The first PAGES pages asked for
+ * are kept, others are made into tmp and have to be freed.
+ */
+static const struct response *
+page(size_t n, struct response *tmp)
+{
+	struct response *p = tmp;
+	size_t i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < npages; ++i)
+		if (pages[i].mixes == n)
+			break;
+	if (i < npages || npages < PAGES) {
+		p = &pages[i];
+		if (i == npages)
+			npages++;
+	}
+	if (p->text == NULL) {
+		p->text = corpus_mixset(dir, n, &p->len);
+		p->mixes = n;
+		etag(p);
+	}
+	pthread_mutex_unlock(&lock);
+	return p;
+}
+
+/*
+ * Parses the head of a request, which it cuts up.  Returns -1 if it is not
+ * an HTTP request.
+ */
+static int
+parse(char *head, struct request *r)
+{
+	char *line, *next, *value;
+
+	memset(r, 0, sizeof(*r));
+	r->range = -1;
+	if ((next = strstr(head, "\r\n")) != NULL) {
+		*next = '\0';
+		next += 2;
+	}
+	if ((r->path = strchr(head, ' ')) == NULL || r->path[1] != '/')
+		return -1;
+	r->path += 2;
+	if ((line = strchr(r->path, ' ')) == NULL)
+		return -1;
+	*line = '\0';
+	if ((r->query = strchr(r->path, '?')) != NULL)
+		*r->query++ = '\0';
+	if (strncmp(r->path, "flaky/", 6) == 0) {
+		r->path += 6;
+		r->flaky = 1;
+	}
+
+	for (line = next; line != NULL && *line != '\0'; line = next) {
+		if ((next = strstr(line, "\r\n")) != NULL) {
+			*next = '\0';
+			next += 2;
+		}
+		if ((value = strchr(line, ':')) == NULL)
+			continue;
+		*value++ = '\0';
+		value += strspn(value, " \t");
+		if (strcasecmp(line, "Content-Length") == 0)
+			r->length = strtoul(value, NULL, 10);
+		else if (strcasecmp(line, "Range") == 0 &&
+		    strncmp(value, "bytes=", 6) == 0)
+			r->range = strtol(value + 6, NULL, 10);
+		else if (strcasecmp(line, "If-None-Match") == 0)
+			snprintf(r->etag, sizeof(r->etag), "%s", value);
+		else if (strcasecmp(line, "Connection") == 0 &&
+		    strcasecmp(value, "close") == 0)
+			r->close = 1;
+	}
+	return 0;
+}
+
+/*
+ * Writes head and body to fd.  Returns -1 if the connection broke.
+ */
+static int
+sendall(int fd, const char *head, size_t hlen, const char *body, size_t blen)
+{
+	struct iovec iov[2];
+	ssize_t n;
+	int i = 0;
+
+	iov[0].iov_base = (void *)head;
+	iov[0].iov_len = hlen;
+	iov[1].iov_base = (void *)body;
+	iov[1].iov_len = blen;
+	while (i < 2) {
+		if ((n = writev(fd, iov + i, 2 - i)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (; i < 2 && (size_t)n >= iov[i].iov_len; ++i)
+			n -= iov[i].iov_len;
+		if (i < 2) {
+			iov[i].iov_base = (char *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Serves the requests that come in on a connection until the client
+ * closes it.
+ */
+static void *
+serve(void *arg)
+{
+	struct request r;
+	char buf[HEADERMAX + 1], *end;
+	size_t head, have, len = 0;
+	ssize_t n;
+	int fd = *(int *)arg;
+
+	free(arg);
+	for (;;) {
+		buf[len] = '\0';
+		if ((end = strstr(buf, "\r\n\r\n")) == NULL) {
+			if (len == HEADERMAX)
+				break;
+			if ((n = read(fd, buf + len, HEADERMAX - len)) <= 0) {
+				if (n == -1 && errno == EINTR)
+					continue;
+				break;
+			}
+			len += n;
+			continue;
+		}
+		end[2] = '\0';
+		head = end + 4 - buf;
+		if (parse(buf, &r) == -1 || handle(fd, &r) == -1 || r.close)
+			break;
+
+		/* the body is not looked at */
+		have = len - head;
+		if (have >= r.length) {
+			len = have - r.length;
+			memmove(buf, buf + head + r.length, len);
+			continue;
+		}
+		for (r.length -= have; r.length > 0; r.length -= n)
+			if ((n = read(fd, buf, r.length < HEADERMAX ?
+			    r.length : HEADERMAX)) <= 0)
+				break;
+		if (r.length > 0)
+			break;
+		len = 0;
+	}
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Serves a track stream from offset range on.  A stream on a flaky path
+ * that is asked for from the start breaks off halfway.
+ */
+static void
+serveaudio(int fd, struct request *r)
+{
+	char extra[128];
+	size_t off = r->range > 0 ? (size_t)r->range : 0;
+
+	if (off >= AUDIOSIZE) {
+		snprintf(extra, sizeof(extra), "Content-Range: bytes */%d\r\n",
+		    AUDIOSIZE);
+		answer(fd, r, 416, "Range Not Satisfiable", "text/plain",
+		    extra, 0, "");
+		return;
+	}
+	r->cut = r->flaky && off == 0;
+	if (r->range < 0) {
+		answer(fd, r, 200, "OK", "audio/mpeg",
+		    "Accept-Ranges: bytes\r\n", AUDIOSIZE, audio);
+		return;
+	}
+	snprintf(extra, sizeof(extra), "Accept-Ranges: bytes\r\n"
+	    "Content-Range: bytes %zu-%d/%d\r\n", off, AUDIOSIZE - 1,
+	    AUDIOSIZE);
+	answer(fd, r, 206, "Partial Content", "audio/mpeg", extra,
+	    AUDIOSIZE - off, audio + off);
+}
+
+static void
+servejson(int fd, const struct request *r, const struct response *p)
+{
+	char extra[64];
+
+	snprintf(extra, sizeof(extra), "ETag: %s\r\n", p->etag);
+	if (strcmp(r->etag, p->etag) == 0)
+		answer(fd, r, 304, "Not Modified", "application/json", extra,
+		    0, "");
+	else
+		answer(fd, r, 200, "OK", "application/json", extra, p->len,
+		    p->text);
+}
+
+/*
+ * Serves the next track, every one a new track with a stream on this
+ * server.
+ */
+static void
+servetrack(int fd, const struct request *r)
+{
+	struct json_object *root, *set, *track;
+	const char *s;
+	char url[128];
+	int id;
+
+	pthread_mutex_lock(&lock);
+	id = ++trackid;
+	pthread_mutex_unlock(&lock);
+	snprintf(url, sizeof(url), "%s%saudio/%d", base,
+	    r->flaky ? "flaky/" : "", id);
+	if ((root = json_tokener_parse(responses[TRACK].text)) == NULL ||
+	    !json_object_object_get_ex(root, "set", &set) ||
+	    !json_object_object_get_ex(set, "track", &track))
+		errx(1, "%s: no track", responses[TRACK].file);
+	json_object_object_add(track, "id", json_object_new_int(id));
+	json_object_object_add(track, "track_file_stream_url",
+	    json_object_new_string(url));
+	if ((s = json_object_to_json_string_ext(root,
+	    JSON_C_TO_STRING_PLAIN)) == NULL)
+		err(1, NULL);
+	answer(fd, r, 200, "OK", "application/json", "", strlen(s), s);
+	json_object_put(root);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-p port] corpus [command [argument ...]]\n",
+	    __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in sin;
+	socklen_t len;
+	pthread_t thread;
+	pid_t pid = -1;
+	size_t i;
+	int ch, fd, on = 1, port = 0, status;
+
+	while ((ch = getopt(argc, argv, "+p:")) != -1) {
+		switch (ch) {
+		case 'p':
+			if ((port = atoi(optarg)) <= 0 || port > 65535)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usage();
+
+	dir = argv[0];
+	for (i = 0; i < NRESPONSES; ++i) {
+		responses[i].text = corpus_load(dir, responses[i].file,
+		    &responses[i].len);
+		etag(&responses[i]);
+	}
+	if ((audio = malloc(AUDIOSIZE)) == NULL)
+		err(1, NULL);
+	for (i = 0; i < AUDIOSIZE; ++i)
+		audio[i] = (char)(i * 31);
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+	len = sizeof(sin);
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+	    listen(fd, 128) == -1 ||
+	    getsockname(fd, (struct sockaddr *)&sin, &len) == -1)
+		err(1, "127.0.0.1:%d", port);
+	snprintf(base, sizeof(base), "http://127.0.0.1:%d/",
+	    ntohs(sin.sin_port));
+	signal(SIGPIPE, SIG_IGN);
+
+	/* the command is started before there are threads to fork */
+	if (argc > 1) {
+		if (setenv("EIGHTPLAY_SERVER", base, 1) == -1)
+			err(1, "setenv");
+		if ((pid = fork()) == -1)
+			err(1, "fork");
+		if (pid == 0) {
+			close(fd);
+			execvp(argv[1], argv + 1);
+			err(127, "%s", argv[1]);
+		}
+	} else {
+		printf("%s\n", base);
+		fflush(stdout);
+	}
+	if (pthread_create(&thread, NULL, listener, &fd) != 0)
+		errx(1, "pthread_create failed");
+	if (pid == -1)
+		pthread_join(thread, NULL);
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			err(1, "waitpid");
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
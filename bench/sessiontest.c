@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2015 Johannes Postma <jgmpostma@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Load test of the client and session API against the server in
+ * EIGHTPLAY_SERVER, which has to be set so that the test never reaches the
+ * real service; make sessiontest runs it under the stand-in server.  A
+ * session gets a play token, plays a mix and reports and skips to the next
+ * track a number of times.  The sessions are run three times: by threads
+ * that use the blocking calls, by the asynchronous calls with their
+ * callbacks run by the curl thread, and by the asynchronous calls with
+ * their callbacks run from client_dispatch in an event loop.  Every run
+ * prints the sessions done per second of wall clock time and per second of
+ * processor time, that is per busy core.
+ */
+#include <sys/resource.h>
+
+#include <err.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "8tracks.h"
+#include "curl.h"
+
+#define SESSIONS	25
+#define THREADS		4
+#define TRACKS		5
+
+/* an asynchronous session */
+struct run {
+	struct session	*session;
+	int		 left;		/* tracks still to play */
+};
+
+extern char		*__progname;
+static struct client	*client;
+static pthread_mutex_t	 lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 cond = PTHREAD_COND_INITIALIZER;
+static unsigned long	 calls, failures;
+static int		 started, running;
+static int		 mixid;
+static int		 nsessions = SESSIONS;
+static int		 nthreads = THREADS;
+static int		 ntracks = TRACKS;
+
+static void	 blocking(void);
+static void	 callback(void);
+static void	 count(int);
+static void	 dispatch(void);
+static void	 finish(struct run *);
+static void	 launch(void);
+static void	 next(struct run *);
+static void	 onreport(int, void *);
+static void	 onsession(int, struct session *, void *);
+static void	 ontrack(int, struct track *, void *);
+static double	 seconds(int);
+static void	 start(void);
+static void	 test(const char *, void (*)(void));
+static void	 usage(void);
+static void	*worker(void *);
+
+/*
+ * Runs the sessions with the blocking calls, from nthreads threads.
+ */
+static void
+blocking(void)
+{
+	pthread_t *threads;
+	int i;
+
+	if ((threads = calloc(nthreads, sizeof(pthread_t))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < nthreads; ++i)
+		if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+			errx(1, "pthread_create failed");
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+/*
+ * Runs the sessions with the asynchronous calls, nthreads at a time, and
+ * waits until the callbacks on the curl thread have finished them.
+ */
+static void
+callback(void)
+{
+	launch();
+	pthread_mutex_lock(&lock);
+	while (running > 0)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+count(int error)
+{
+	pthread_mutex_lock(&lock);
+	calls++;
+	if (error != CLIENT_OK)
+		failures++;
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Like callback, but the callbacks are run here by client_dispatch on a
+ * client of its own.
+ */
+static void
+dispatch(void)
+{
+	struct client *c = client;
+	struct pollfd pfd;
+	int n;
+
+	if ((client = client_new(NULL)) == NULL)
+		err(1, NULL);
+	if ((pfd.fd = client_fd(client)) == -1)
+		err(1, "client_fd");
+	pfd.events = POLLIN;
+	launch();
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		n = running;
+		pthread_mutex_unlock(&lock);
+		if (n == 0)
+			break;
+		if (poll(&pfd, 1, 1000) > 0)
+			client_dispatch(client);
+	}
+	client_free(client);
+	client = c;
+}
+
+/*
+ * Ends an asynchronous session and starts the next one in its place.
+ */
+static void
+finish(struct run *r)
+{
+	int more;
+
+	session_free(r->session);
+	free(r);
+	pthread_mutex_lock(&lock);
+	if ((more = started < nsessions * nthreads))
+		started++;
+	else if (--running == 0)
+		pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	if (more)
+		start();
+}
+
+/*
+ * Starts the first nthreads asynchronous sessions.
+ */
+static void
+launch(void)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	started = running = nthreads;
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < nthreads; ++i)
+		start();
+}
+
+static void
+next(struct run *r)
+{
+	int n;
+
+	if ((n = session_nextasync(r->session, ontrack, r)) != CLIENT_OK) {
+		count(n);
+		finish(r);
+	}
+}
+
+static void
+onreport(int error, void *arg)
+{
+	struct run *r = arg;
+
+	count(error);
+	if (error != CLIENT_OK || --r->left == 0)
+		finish(r);
+	else
+		next(r);
+}
+
+static void
+onsession(int error, struct session *s, void *arg)
+{
+	struct run *r = arg;
+	int n;
+
+	count(error);
+	if (error != CLIENT_OK) {
+		finish(r);
+		return;
+	}
+	r->session = s;
+	if ((n = session_playasync(s, mixid, ontrack, r)) != CLIENT_OK) {
+		count(n);
+		finish(r);
+	}
+}
+
+static void
+ontrack(int error, struct track *track, void *arg)
+{
+	struct run *r = arg;
+	int n;
+
+	count(error);
+	if (error != CLIENT_OK) {
+		finish(r);
+		return;
+	}
+	if (track->lastflag)
+		r->left = 1;
+	n = session_reportasync(r->session, track->id, onreport, r);
+	track_free(track);
+	if (n != CLIENT_OK) {
+		count(n);
+		finish(r);
+	}
+}
+
+/*
+ * Returns the seconds of wall clock time, or of processor time if cpu is
+ * set, since some point in the past.
+ */
+static double
+seconds(int cpu)
+{
+	struct timespec ts;
+	struct rusage ru;
+
+	if (cpu) {
+		getrusage(RUSAGE_SELF, &ru);
+		return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Starts an asynchronous session.
+ */
+static void
+start(void)
+{
+	struct run *r;
+	int n;
+
+	if ((r = calloc(1, sizeof(struct run))) == NULL)
+		err(1, NULL);
+	r->left = ntracks;
+	if ((n = session_newasync(client, onsession, r)) != CLIENT_OK) {
+		count(n);
+		finish(r);
+	}
+}
+
+static void
+test(const char *name, void (*fn)(void))
+{
+	double cpu, wall;
+	int n;
+
+	calls = failures = 0;
+	started = running = 0;
+	wall = seconds(0);
+	cpu = seconds(1);
+	fn();
+	wall = seconds(0) - wall;
+	cpu = seconds(1) - cpu;
+	n = nsessions * nthreads;
+	printf("%-9s %6d sessions %7lu calls %5lu failed %8.0f ms "
+	    "%8.1f sessions/s %8.1f sessions/cpu-s\n", name, n, calls,
+	    failures, wall * 1e3, n / wall, cpu > 0 ? n / cpu : 0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n tracks] [-s sessions] [-t threads] "
+	    "[mix]\n", __progname);
+	exit(1);
+}
+
+/*
+ * Runs nsessions sessions one after the other with the blocking calls.
+ */
+static void *
+worker(void *arg)
+{
+	struct session *s;
+	struct track *track;
+	int i, j, last, n;
+
+	(void)arg;
+	for (i = 0; i < nsessions; ++i) {
+		count(n = session_new(client, NULL, &s));
+		if (n != CLIENT_OK)
+			continue;
+		count(n = session_play(s, mixid, &track));
+		for (j = 0; n == CLIENT_OK; j++) {
+			last = track->lastflag || j == ntracks - 1;
+			count(n = session_report(s, track->id));
+			track_free(track);
+			if (n != CLIENT_OK || last)
+				break;
+			count(n = session_next(s, &track));
+		}
+		session_free(s);
+	}
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct mix *mix, **mixes;
+	size_t size;
+	int ch, n;
+
+	while ((ch = getopt(argc, argv, "n:s:t:")) != -1) {
+		switch (ch) {
+		case 'n':
+			ntracks = atoi(optarg);
+			break;
+		case 's':
+			nsessions = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1 || ntracks <= 0 || nsessions <= 0 || nthreads <= 0)
+		usage();
+	if (getenv("EIGHTPLAY_SERVER") == NULL)
+		errx(1, "EIGHTPLAY_SERVER is not set; run me under bench/server");
+
+	curl_init();
+	if ((client = client_new(NULL)) == NULL)
+		err(1, NULL);
+	if (argc == 1) {
+		if ((n = client_getmix(client, argv[0], &mix)) != CLIENT_OK)
+			errx(1, "%s: %s", argv[0], client_strerror(n));
+		mixid = mix->id;
+		mix_free(mix);
+	} else {
+		n = client_search(client, "all:popular", 1, 1, &mixes, &size);
+		if (n != CLIENT_OK || size == 0)
+			errx(1, "no mix to play: %s", client_strerror(n));
+		mixid = mixes[0]->id;
+		mixset_free(&mixes, size);
+	}
+
+	printf("%ld cores, %d threads of %d sessions of %d tracks\n",
+	    sysconf(_SC_NPROCESSORS_ONLN), nthreads, nsessions, ntracks);
+	test("blocking", blocking);
+	n = failures > 0;
+	test("callback", callback);
+	n |= failures > 0;
+	test("dispatch", dispatch);
+	n |= failures > 0;
+
+	client_free(client);
+	curl_exit();
+	return n;
+}
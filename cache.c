@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2015 Johannes Postma <jgmpostma@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * On-disk track cache.  Every cached track is stored in a file named after
+ * its track id.  Files are written under a temporary name and renamed into
+ * place once complete, so a cache entry is never seen half written.  The
+ * modification time of an entry is bumped on every hit and the least
+ * recently used entries are removed when the cache grows beyond CACHEMAX.
+ *
+ * API responses are kept in the same way, in files named after a hash of
+ * the request URL.  Such a file holds the URL, the expiry time, the ETag
+ * and Last-Modified validators on a line each, followed by the body.  They
+ * are limited to RESPONSEMAX, which is enforced when the cache is opened.
+ */
+#include <sys/stat.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "curl.h"
+
+#define CACHEMAX	(512L * 1024 * 1024)	/* bytes */
+#define RESPONSEMAX	(16L * 1024 * 1024)	/* bytes */
+
+struct entry {
+	char	*name;
+	off_t	 size;
+	time_t	 mtime;
+};
+
+static char			*responsedir;
+static char			*trackdir;
+static struct cachestats	 stats;
+static pthread_mutex_t		 statslock = PTHREAD_MUTEX_INITIALIZER;
+
+static int	entrycmp(const void *, const void *);
+static unsigned long	evict(const char *, off_t);
+static char	*nextline(char **);
+static char	*responsepath(const char *);
+static char	*trackpath(int);
+
+void
+cache_init(void)
+{
+	trackdir = cache_dir("tracks");
+	responsedir = cache_dir("responses");
+	if (responsedir != NULL)
+		evict(responsedir, RESPONSEMAX);
+}
+
+void
+cache_exit(void)
+{
+	free(trackdir);
+	trackdir = NULL;
+	free(responsedir);
+	responsedir = NULL;
+}
+
+/*
+ * Starts writing a response to the cache.  The validators and expiry time
+ * are taken from r, the body is to be written to f->fp.  Returns 0 on
+ * success and -1 on failure.
+ */
+int
+cache_beginresponse(struct cachefile *f, const char *url,
+    const struct response *r)
+{
+	int fd;
+
+	f->fp = NULL;
+	if (responsedir == NULL)
+		return -1;
+	f->path = responsepath(url);
+	f->tmp = cache_path(responsedir, ".tmp.XXXXXX");
+	if (f->path == NULL || f->tmp == NULL || (fd = mkstemp(f->tmp)) == -1)
+		goto error;
+	if ((f->fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(f->tmp);
+		goto error;
+	}
+	fprintf(f->fp, "%s\n%lld\n%s\n%s\n", url, (long long)r->expires,
+	    r->etag ? r->etag : "", r->lastmodified ? r->lastmodified : "");
+	return 0;
+error:
+	free(f->tmp);
+	free(f->path);
+	return -1;
+}
+
+/*
+ * Returns the path of the cache subdirectory name, creating it when
+ * needed.  Returns NULL when there is no usable cache directory.
+ */
+char *
+cache_dir(const char *name)
+{
+	char *base, *dir = NULL, *home, *path = NULL;
+
+	if ((base = getenv("XDG_CACHE_HOME")) != NULL && *base != '\0')
+		base = cache_path(base, "");
+	else if ((home = getenv("HOME")) != NULL && *home != '\0')
+		base = cache_path(home, ".cache");
+	else
+		return NULL;
+
+	if (base == NULL || (dir = cache_path(base, "8play")) == NULL ||
+	    (path = cache_path(dir, name)) == NULL)
+		warnx("no cache directory: out of memory");
+	else if ((mkdir(base, 0700) == -1 && errno != EEXIST) ||
+	    (mkdir(dir, 0700) == -1 && errno != EEXIST) ||
+	    (mkdir(path, 0700) == -1 && errno != EEXIST)) {
+		warn("%s", path);
+		free(path);
+		path = NULL;
+	}
+	free(dir);
+	free(base);
+	return path;
+}
+
+/*
+ * Finishes writing a response.  Unless commit is set, or writing failed,
+ * the response is thrown away.
+ */
+void
+cache_endresponse(struct cachefile *f, int commit)
+{
+	if (f->fp == NULL)
+		return;
+	if (fclose(f->fp) != 0)
+		commit = 0;
+	if (!commit || rename(f->tmp, f->path) == -1)
+		unlink(f->tmp);
+	free(f->tmp);
+	free(f->path);
+	f->fp = NULL;
+}
+
+void
+cache_freeresponse(struct response *r)
+{
+	free(r->body);
+	free(r->etag);
+	free(r->lastmodified);
+	r->body = r->etag = r->lastmodified = NULL;
+}
+
+void
+cache_getstats(struct cachestats *s)
+{
+	pthread_mutex_lock(&statslock);
+	*s = stats;
+	pthread_mutex_unlock(&statslock);
+}
+
+/*
+ * Loads the cached response for url.  Returns 0 on success and -1 if there
+ * is no cached response.
+ */
+int
+cache_loadresponse(const char *url, struct response *r)
+{
+	FILE *fp;
+	struct stat st;
+	char *buf, *etag, *expires, *modified, *p, *path, *u;
+	size_t len;
+	int ret = -1;
+
+	r->body = r->etag = r->lastmodified = NULL;
+	if (responsedir == NULL)
+		return -1;
+	if ((path = responsepath(url)) == NULL)
+		return -1;
+	fp = fopen(path, "r");
+	free(path);
+	if (fp == NULL)
+		return -1;
+	if (fstat(fileno(fp), &st) == -1) {
+		fclose(fp);
+		return -1;
+	}
+	/* a hit makes the entry the most recently used one */
+	futimens(fileno(fp), NULL);
+	len = (size_t)st.st_size;
+	if ((buf = malloc(len + 1)) == NULL || fread(buf, 1, len, fp) != len)
+		goto end;
+	buf[len] = '\0';
+
+	p = buf;
+	if ((u = nextline(&p)) == NULL || strcmp(u, url) != 0 ||
+	    (expires = nextline(&p)) == NULL ||
+	    (etag = nextline(&p)) == NULL ||
+	    (modified = nextline(&p)) == NULL)
+		goto end;
+	r->expires = (time_t)strtoll(expires, NULL, 10);
+	if ((*etag != '\0' && (r->etag = strdup(etag)) == NULL) ||
+	    (*modified != '\0' &&
+	    (r->lastmodified = strdup(modified)) == NULL) ||
+	    (r->body = strdup(p)) == NULL) {
+		cache_freeresponse(r);
+		goto end;
+	}
+	ret = 0;
+end:
+	free(buf);
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * Returns the path of the cached copy of a track, or NULL if the track is
+ * not in the cache.
+ */
+char *
+cache_lookup(int trackid)
+{
+	char *path;
+	int hit;
+
+	if (trackdir == NULL || (path = trackpath(trackid)) == NULL)
+		return NULL;
+	/* a hit makes the entry the most recently used one */
+	hit = utimensat(AT_FDCWD, path, NULL, 0) == 0;
+
+	pthread_mutex_lock(&statslock);
+	if (hit)
+		stats.hits++;
+	else
+		stats.misses++;
+	pthread_mutex_unlock(&statslock);
+
+	if (!hit) {
+		free(path);
+		path = NULL;
+	}
+	return path;
+}
+
+/*
+ * Returns the path of name in dir, or dir itself if name is empty.
+ * Returns NULL if out of memory.
+ */
+char *
+cache_path(const char *dir, const char *name)
+{
+	char *path;
+	size_t len;
+
+	len = strlen(dir) + 1 + strlen(name) + 1;
+	if ((path = malloc(len)) == NULL)
+		return NULL;
+	if (*name == '\0')
+		snprintf(path, len, "%s", dir);
+	else
+		snprintf(path, len, "%s/%s", dir, name);
+	return path;
+}
+
+void
+cache_saveresponse(const char *url, const struct response *r)
+{
+	struct cachefile f;
+
+	if (r->body == NULL || cache_beginresponse(&f, url, r) == -1)
+		return;
+	fputs(r->body, f.fp);
+	cache_endresponse(&f, 1);
+}
+
+/*
+ * Downloads a track into the cache.  The download is abandoned as soon as
+ * stop returns non-zero.  Returns 0 on success and -1 on failure.
+ */
+int
+cache_store(int trackid, const char *url, int (*stop)(void *), void *arg)
+{
+	FILE *fp;
+	char *path, *tmp;
+	unsigned long n;
+	int fd, ret = -1;
+
+	if (trackdir == NULL || (path = trackpath(trackid)) == NULL)
+		return -1;
+	if (access(path, F_OK) == 0) {
+		free(path);
+		return 0;
+	}
+	if ((tmp = cache_path(trackdir, ".tmp.XXXXXX")) == NULL)
+		goto end;
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("%s", tmp);
+		goto end;
+	}
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		goto end;
+	}
+	if (curl_save(url, fp, stop, arg) == 0 && fflush(fp) == 0 &&
+	    fsync(fd) == 0)
+		ret = 0;
+	fclose(fp);
+	if (ret == 0 && rename(tmp, path) == -1)
+		ret = -1;
+	if (ret == -1)
+		unlink(tmp);
+	else if ((n = evict(trackdir, CACHEMAX)) > 0) {
+		pthread_mutex_lock(&statslock);
+		stats.evictions += n;
+		pthread_mutex_unlock(&statslock);
+	}
+end:
+	free(tmp);
+	free(path);
+	return ret;
+}
+
+static int
+entrycmp(const void *a, const void *b)
+{
+	const struct entry *x = a, *y = b;
+
+	if (x->mtime < y->mtime)
+		return -1;
+	return x->mtime > y->mtime;
+}
+
+/*
+ * Removes the least recently used entries of the cache directory name until
+ * it fits in max bytes.  Returns the number of entries removed.
+ */
+static unsigned long
+evict(const char *name, off_t max)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct entry *e = NULL, *tmp;
+	struct stat st;
+	char *path;
+	size_t i, len = 0, size = 0;
+	off_t total = 0;
+	unsigned long n = 0;
+
+	if ((dir = opendir(name)) == NULL)
+		return 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')	/* skip downloads in progress */
+			continue;
+		if ((path = cache_path(name, de->d_name)) == NULL)
+			break;
+		if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+			free(path);
+			continue;
+		}
+		if (len == size) {
+			/* out of memory, evict from what was listed */
+			tmp = realloc(e, (size ? size * 2 : 64) *
+			    sizeof(struct entry));
+			if (tmp == NULL) {
+				free(path);
+				break;
+			}
+			size = size ? size * 2 : 64;
+			e = tmp;
+		}
+		e[len].name = path;
+		e[len].size = st.st_size;
+		e[len].mtime = st.st_mtime;
+		total += st.st_size;
+		len++;
+	}
+	closedir(dir);
+
+	qsort(e, len, sizeof(struct entry), entrycmp);
+	for (i = 0; i < len; ++i) {
+		if (total > max && unlink(e[i].name) == 0) {
+			total -= e[i].size;
+			n++;
+		}
+		free(e[i].name);
+	}
+	free(e);
+	return n;
+}
+
+/*
+ * Returns the line *p points to and lets *p point past it.
+ */
+static char *
+nextline(char **p)
+{
+	char *line, *nl;
+
+	if ((nl = strchr(*p, '\n')) == NULL)
+		return NULL;
+	*nl = '\0';
+	line = *p;
+	*p = nl + 1;
+	return line;
+}
+
+/*
+ * The file name of a cached response is the 64-bit FNV-1a hash of its URL.
+ */
+static char *
+responsepath(const char *url)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	char name[17];
+
+	for (; *url != '\0'; ++url) {
+		h ^= (unsigned char)*url;
+		h *= 1099511628211ULL;
+	}
+	snprintf(name, sizeof(name), "%016llx", h);
+	return cache_path(responsedir, name);
+}
+
+static char *
+trackpath(int trackid)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "%d", trackid);
+	return cache_path(trackdir, name);
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2015 Johannes Postma <jgmpostma@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef CACHE_H
+#define CACHE_H
+
+struct response {
+	char	*body;
+	char	*etag;
+	char	*lastmodified;
+	time_t	 expires;
+};
+
+/* a response being written to the cache */
+struct cachefile {
+	FILE	*fp;
+	char	*path;
+	char	*tmp;
+};
+
+struct cachestats {
+	unsigned long	hits;
+	unsigned long	misses;
+	unsigned long	evictions;
+};
+
+__BEGIN_DECLS
+
+void	cache_init(void);
+void	cache_exit(void);
+
+int	cache_beginresponse(struct cachefile *f, const char *url,
+    const struct response *r);
+char	*cache_dir(const char *name);
+void	cache_endresponse(struct cachefile *f, int commit);
+void	cache_freeresponse(struct response *r);
+void	cache_getstats(struct cachestats *stats);
+int	cache_loadresponse(const char *url, struct response *r);
+char	*cache_lookup(int trackid);
+char	*cache_path(const char *dir, const char *name);
+void	cache_saveresponse(const char *url, const struct response *r);
+int	cache_store(int trackid, const char *url, int (*stop)(void *),
+    void *arg);
+
+__END_DECLS
+
+#endif	/* CACHE_H */
@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2015 Johannes Postma <jgmpostma@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A player running as a daemon is controlled over a Unix domain socket.
+ * Every connection carries one command line and receives the reply, after
+ * which the daemon closes it.  Connections are served on threads of their
+ * own, so a slow client or a lookup never holds up playback or the other
+ * clients.  Commands that concern playback are turned into keys, which
+ * are posted to a pipe that the player polls.
+ */
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "control.h"
+
+#define LINEMAX		4096	/* longest command line */
+#define READTIMEOUT	10	/* seconds a client has to send its command */
+
+static char		*sockpath;
+static int		 listenfd = -1;
+static int		 keys[2] = { -1, -1 };	/* pipe of posted keys */
+static int		 wake[2] = { -1, -1 };	/* stops the listener */
+static pthread_t	 listener;
+static void		(*handler)(char *, FILE *);
+static int		 nclients;	/* being served */
+static pthread_mutex_t	 clientlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 clientcond = PTHREAD_COND_INITIALIZER;
+
+static int	 alive(const struct sockaddr_un *);
+static void	*serve(void *);
+static void	*serveclient(void *);
+static int	 sockaddr(struct sockaddr_un *, const char *);
+
+/*
+ * Starts to listen for commands on the socket at path.  handler is called
+ * with every command line and a stream for the reply.  A socket left
+ * behind by a daemon that is no longer running is replaced.  Returns 0 on
+ * success and -1 if the socket could not be set up.
+ */
+int
+control_init(const char *path, void (*h)(char *, FILE *))
+{
+	struct sockaddr_un sa;
+	mode_t mask;
+	int n;
+
+	if (sockaddr(&sa, path) == -1)
+		return -1;
+	if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	mask = umask(0077);
+	n = bind(listenfd, (struct sockaddr *)&sa, sizeof(sa));
+	if (n == -1 && errno == EADDRINUSE && !alive(&sa)) {
+		unlink(path);
+		n = bind(listenfd, (struct sockaddr *)&sa, sizeof(sa));
+	}
+	umask(mask);
+	/* a client gone before it is accepted must not block the listener */
+	if (n == -1 || listen(listenfd, 16) == -1 ||
+	    fcntl(listenfd, F_SETFL, O_NONBLOCK) == -1)
+		goto error;
+	if ((sockpath = strdup(path)) == NULL)
+		err(1, NULL);
+
+	/* a client that hangs up early must not take the daemon down */
+	signal(SIGPIPE, SIG_IGN);
+	if (pipe(keys) == -1 || pipe(wake) == -1)
+		err(1, "pipe");
+	handler = h;
+	if (pthread_create(&listener, NULL, serve, NULL) != 0)
+		errx(1, "pthread_create failed");
+	return 0;
+error:
+	close(listenfd);
+	listenfd = -1;
+	return -1;
+}
+
+/*
+ * Stops listening and removes the socket.  Clients that are still being
+ * served are waited for, as their commands may be waiting on requests.
+ */
+void
+control_exit(void)
+{
+	if (listenfd == -1)
+		return;
+	while (write(wake[1], "", 1) == -1 && errno == EINTR)
+		continue;
+	pthread_join(listener, NULL);
+	pthread_mutex_lock(&clientlock);
+	while (nclients > 0)
+		pthread_cond_wait(&clientcond, &clientlock);
+	pthread_mutex_unlock(&clientlock);
+	close(listenfd);
+	listenfd = -1;
+	close(wake[0]);
+	close(wake[1]);
+	wake[0] = wake[1] = -1;
+	unlink(sockpath);
+	free(sockpath);
+	sockpath = NULL;
+}
+
+/*
+ * Returns a descriptor that is readable when a key has been posted, or -1
+ * if the daemon is not listening.
+ */
+int
+control_fd(void)
+{
+	return keys[0];
+}
+
+/*
+ * Returns the next posted key, or -1 if none could be read.
+ */
+int
+control_getkey(void)
+{
+	int key;
+
+	if (read(keys[0], &key, sizeof(key)) != sizeof(key))
+		return -1;
+	return key;
+}
+
+/*
+ * Returns the default path of the control socket: 8play.sock in
+ * XDG_RUNTIME_DIR, or in the cache directory if that is not set.
+ */
+char *
+control_path(void)
+{
+	const char *dir;
+	char *p, *run = NULL;
+	size_t len;
+
+	if ((dir = getenv("XDG_RUNTIME_DIR")) == NULL || *dir == '\0') {
+		if ((run = cache_dir("run")) == NULL)
+			return NULL;
+		dir = run;
+	}
+	len = strlen(dir) + strlen("/8play.sock") + 1;
+	if ((p = malloc(len)) == NULL)
+		err(1, NULL);
+	snprintf(p, len, "%s/8play.sock", dir);
+	free(run);
+	return p;
+}
+
+/*
+ * Posts a key for the player to pick up with control_getkey.
+ */
+void
+control_postkey(int key)
+{
+	if (write(keys[1], &key, sizeof(key)) != sizeof(key))
+		warn("control");
+}
+
+/*
+ * Sends a command line to the daemon listening at path and copies the
+ * reply to out.  Returns 0 on success, 1 if the daemon replied with an
+ * error, and -1 if no daemon could be reached.
+ */
+int
+control_send(const char *path, const char *line, FILE *out)
+{
+	struct sockaddr_un sa;
+	FILE *fp;
+	char buf[LINEMAX];
+	size_t len;
+	int fd, first = 1, ret = 0;
+
+	if (sockaddr(&sa, path) == -1 ||
+	    (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	len = strlen(line);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+	    write(fd, line, len) != (ssize_t)len || write(fd, "\n", 1) != 1 ||
+	    (fp = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return -1;
+	}
+	shutdown(fd, SHUT_WR);
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		if (first && strncmp(buf, "error:", 6) == 0)
+			ret = 1;
+		first = 0;
+		fputs(buf, out);
+	}
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * Returns whether a daemon still answers on the socket at sa.
+ */
+static int
+alive(const struct sockaddr_un *sa)
+{
+	int fd, n;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return 1;
+	n = connect(fd, (const struct sockaddr *)sa, sizeof(*sa));
+	close(fd);
+	return n == 0 || errno != ECONNREFUSED;
+}
+
+/*
+ * Accepts connections and hands each to a thread of its own, until
+ * control_exit writes to the wake pipe.
+ */
+static void *
+serve(void *arg)
+{
+	struct pollfd pfd[2];
+	pthread_t t;
+	int *fd;
+
+	(void)arg;
+	pfd[0].fd = listenfd;
+	pfd[1].fd = wake[0];
+	pfd[0].events = pfd[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("poll");
+			break;
+		}
+		if (pfd[1].revents & POLLIN)
+			break;
+		if ((fd = malloc(sizeof(int))) == NULL)
+			err(1, NULL);
+		if ((*fd = accept(listenfd, NULL, NULL)) == -1) {
+			free(fd);
+			if (errno == EINTR || errno == ECONNABORTED ||
+			    errno == EAGAIN || errno == EWOULDBLOCK)
+				continue;
+			warn("accept");
+			break;
+		}
+		/* on some systems the connection inherits O_NONBLOCK */
+		fcntl(*fd, F_SETFL, 0);
+		pthread_mutex_lock(&clientlock);
+		nclients++;
+		pthread_mutex_unlock(&clientlock);
+		if (pthread_create(&t, NULL, serveclient, fd) != 0) {
+			warnx("pthread_create failed");
+			pthread_mutex_lock(&clientlock);
+			nclients--;
+			pthread_mutex_unlock(&clientlock);
+			close(*fd);
+			free(fd);
+			continue;
+		}
+		pthread_detach(t);
+	}
+	return NULL;
+}
+
+/*
+ * Reads the command line of a client and lets the handler reply to it.
+ */
+static void *
+serveclient(void *arg)
+{
+	struct timeval tv = { .tv_sec = READTIMEOUT, .tv_usec = 0 };
+	FILE *in, *out;
+	char line[LINEMAX];
+	int fd = *(int *)arg, wfd;
+
+	free(arg);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if ((wfd = dup(fd)) == -1 || (in = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		if (wfd != -1)
+			close(wfd);
+		goto end;
+	}
+	if ((out = fdopen(wfd, "w")) == NULL) {
+		close(wfd);
+		fclose(in);
+		goto end;
+	}
+	if (fgets(line, sizeof(line), in) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		handler(line, out);
+	}
+	fclose(out);
+	fclose(in);
+end:
+	pthread_mutex_lock(&clientlock);
+	if (--nclients == 0)
+		pthread_cond_signal(&clientcond);
+	pthread_mutex_unlock(&clientlock);
+	return NULL;
+}
+
+static int
+sockaddr(struct sockaddr_un *sa, const char *path)
+{
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sa->sun_path, path);
+	return 0;
+}
@@ -14,94 +14,1401 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <err.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <curl/curl.h>
+#include <json.h>
+
+#include "cache.h"
+#include "curl.h"
+#include "stats.h"
 
 #define APIKEY		"e233c13d38d96e3a3a0474723f6b3fcd21904979"
 #define APIVERSION	3
 #define USERAGENT	"8play"
+#define POOLSIZE	4	/* idle easy handles kept for reuse */
+#define CONNECTTIMEOUT	10	/* seconds to set up a connection */
+#define APITIMEOUT	30	/* seconds an API request may take */
+#define STALLTIME	20	/* seconds a transfer may stall */
+#define RETRIES		3	/* attempts after the first one */
+#define RETRYMIN	250	/* ms before the first retry, doubled after each */
+
+/*
+ * An API request.  Response bodies are not buffered: every chunk that
+ * arrives is fed to the JSON tokener right away, so parsing overlaps with
+ * the transfer, and copied to the response cache if the response may be
+ * reused.
+ */
+struct request {
+	CURL			*curl;
+	const char		*url;
+	struct curl_slist	*hdr;
+	json_tokener		*tok;
+	struct json_object	*root;
+	long			 status;	/* HTTP, 0 without a response */
+	int			 done;		/* tokener finished */
+	long			 ttl;		/* -1 if not cacheable */
+	int			 copy;		/* copy the body to cache */
+	int			 stale;		/* cached needs revalidation */
+	struct response		 cached;
+	struct response		 resp;		/* validators received */
+	struct cachefile	 cache;
+};
 
-struct curlbuf {
-	char	*data;
-	size_t	pos;
+/*
+ * A request of curl_fetchasync.  These are all carried out by one thread,
+ * the event loop, which drives a single multi handle: any number of them
+ * can be in flight without a thread waiting on each.  A request is on one
+ * list at a time, the submitted, the active or the retry list.
+ */
+struct async {
+	struct request	 r;
+	char		*url;
+	char		*post;
+	long		 ttl;
+	int		 idempotent;	/* may be sent more than once */
+	int		 tries;
+	double		 retryat;	/* when to try again, in ms */
+	void		(*cb)(struct json_object *, long, void *);
+	void		*arg;
+	struct async	*prev;
+	struct async	*next;
 };
 
-static size_t	curlwrite(void *, size_t, size_t, void *);
+struct savestop {
+	int	(*stop)(void *);
+	void	*arg;
+};
+
+/* a blocking request waiting for the event loop */
+struct wait {
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 cond;
+	int			 done;
+	struct json_object	*root;
+};
+
+/*
+ * Easy handles are kept in a small pool instead of being created for every
+ * request.  A handle keeps its connections open, so consecutive API calls
+ * reuse the same connection to the server.  All handles share their DNS
+ * cache and TLS sessions through a single share object, so a handle that
+ * does need a new connection skips the lookup and the full handshake.
+ */
+static struct curl_slist	*header;
+static CURL			*pool[POOLSIZE];
+static size_t			 poolsize;
+static pthread_mutex_t		 poollock = PTHREAD_MUTEX_INITIALIZER;
+static CURLSH			*share;
+static pthread_mutex_t		 sharelock[CURL_LOCK_DATA_LAST];
+static struct curlstats		 stats;
+static pthread_mutex_t		 statslock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Addresses of the API server are remembered across runs, so that a new
+ * run can connect without waiting for a name lookup.  Pinned addresses
+ * are handed to every handle and expire from the DNS cache like looked up
+ * ones do.  An address that cannot be connected to is unpinned, and the
+ * next handle drops it from the DNS cache.  Lists that were handed to
+ * handles are retired rather than freed, as handles keep pointing to them.
+ * Servers that announce an alternative service, such as HTTP/3, are
+ * remembered in the alt-svc file.
+ */
+static struct curlhost		 hosts[MAXHOSTS];
+static size_t			 nhosts;
+static struct curl_slist	*resolve;
+static struct curl_slist	*unresolve;	/* to drop from the DNS cache */
+static struct curl_slist	*retired;
+static char			*altsvc;
+static pthread_mutex_t		 hostlock = PTHREAD_MUTEX_INITIALIZER;
+
+static CURLM			*multi;		/* of the event loop */
+static pthread_t		 loopthread;
+static struct async		*submitted;	/* not picked up yet */
+static struct async		*lastsubmitted;
+static int			 loopquit;
+static pthread_mutex_t		 looplock = PTHREAD_MUTEX_INITIALIZER;
+
+static void	 addstats(CURL *, const char *, CURLcode);
+static void	 async_done(struct async *);
+static void	 async_start(struct async *, struct async **);
+static int	 async_submit(const char *, const char *, long, int,
+		    void (*)(struct json_object *, long, void *), void *);
+static CURL	*curl_gethandle(void);
+static void	 curl_puthandle(CURL *);
+static size_t	 curlheader(char *, size_t, size_t, void *);
+static size_t	 curlwrite(void *, size_t, size_t, void *);
+static void	 endpoint(const char *, char *, size_t);
+static void	 gettiming(CURL *, CURLcode, struct timing *);
+static char	*headerdup(const char *, size_t);
+static void	 learnhost(CURL *, const char *);
+static void	*loop(void *);
+static double	 monotime(void);
+static void	 msleep(long);
+static void	 request_finish(struct request *, CURLcode);
+static int	 request_init(struct request *, const char *, const char *,
+		    long);
+static void	 retire(struct curl_slist *);
+static long	 retrydelay(int);
+static int	 retryable(CURL *, CURLcode, int);
+static int	 savestop(void *, curl_off_t, curl_off_t, curl_off_t,
+		    curl_off_t);
+static int	 sethandle(CURL *);
+static int	 setresolve(CURL *);
+static void	 sharedolock(CURL *, curl_lock_data, curl_lock_access, void *);
+static void	 shareunlock(CURL *, curl_lock_data, void *);
+static int	 slistadd(struct curl_slist **, const char *);
+static void	 unpinhost(CURL *, const char *);
+static int	 urlhost(const char *, char *, size_t);
+static struct json_object *waitfetch(const char *, const char *, long, int);
+static void	 waitdone(struct json_object *, long, void *);
 
 void
 curl_init(void)
 {
 	CURLcode n;
+	int i;
 
 	n = curl_global_init(CURL_GLOBAL_ALL);
 	if (n != CURLE_OK) {
 		errx(1, "curl_global_init failed, error: %s",
 		    curl_easy_strerror(n));
 	}
+
+	header = curl_slist_append(NULL, "X-Api-Key: " APIKEY);
+	header = curl_slist_append(header, "X-Api-Version: 3");
+	header = curl_slist_append(header, "User-Agent: " USERAGENT);
+	header = curl_slist_append(header, "Accept: application/json");
+	if (header == NULL)
+		errx(1, "curl: set header failed");
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+		pthread_mutex_init(&sharelock[i], NULL);
+	share = curl_share_init();
+	if (share == NULL)
+		errx(1, "curl_share_init failed");
+	if (curl_share_setopt(share, CURLSHOPT_LOCKFUNC, sharedolock) != 0 ||
+	    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, shareunlock) != 0 ||
+	    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != 0 ||
+	    curl_share_setopt(share, CURLSHOPT_SHARE,
+	    CURL_LOCK_DATA_SSL_SESSION) != 0)
+		errx(1, "curl_share_setopt failed");
+
+	if ((multi = curl_multi_init()) == NULL)
+		errx(1, "curl_multi_init failed");
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	if (pthread_create(&loopthread, NULL, loop, NULL) != 0)
+		errx(1, "pthread_create failed");
 }
 
 void
 curl_exit(void)
 {
+	int i;
+
+	pthread_mutex_lock(&looplock);
+	loopquit = 1;
+	pthread_mutex_unlock(&looplock);
+	curl_multi_wakeup(multi);
+	pthread_join(loopthread, NULL);
+	curl_multi_cleanup(multi);
+
+	while (poolsize > 0)
+		curl_easy_cleanup(pool[--poolsize]);
+	curl_share_cleanup(share);
+	curl_slist_free_all(resolve);
+	curl_slist_free_all(unresolve);
+	curl_slist_free_all(retired);
+	free(altsvc);
+	for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+		pthread_mutex_destroy(&sharelock[i]);
+	curl_slist_free_all(header);
 	curl_global_cleanup();
 }
 
+/*
+ * Counts a finished API request to url in the request statistics.
+ */
+static void
+addstats(CURL *curl, const char *url, CURLcode n)
+{
+	struct timing t;
+	char name[32];
+
+	gettiming(curl, n, &t);
+	endpoint(url, name, sizeof(name));
+	stats_request(name, &t);
+	pthread_mutex_lock(&statslock);
+	stats.requests++;
+	if (n != CURLE_OK)
+		stats.failed++;
+	stats.time += t.total;
+	stats.bytes += t.bytes;
+	pthread_mutex_unlock(&statslock);
+}
+
+/*
+ * Hands the response of a request to its callback and frees the request.
+ */
+static void
+async_done(struct async *a)
+{
+	a->cb(a->r.root, a->r.status, a->arg);
+	free(a->url);
+	free(a->post);
+	free(a);
+}
+
+/*
+ * Adds a request to the multi handle of the event loop and to the active
+ * list, or completes it right away if the response cache answers it or it
+ * cannot be set up.
+ */
+static void
+async_start(struct async *a, struct async **active)
+{
+	if (request_init(&a->r, a->url, a->post, a->ttl) != 0) {
+		async_done(a);
+		return;
+	}
+	curl_easy_setopt(a->r.curl, CURLOPT_PRIVATE, a);
+	curl_easy_setopt(a->r.curl, CURLOPT_PIPEWAIT, 1L);
+	curl_multi_add_handle(multi, a->r.curl);
+	a->prev = NULL;
+	if ((a->next = *active) != NULL)
+		a->next->prev = a;
+	*active = a;
+}
+
+/*
+ * Queues a request for the event loop and wakes it up.  Once curl_exit has
+ * stopped the loop, the request fails right away.  Returns 0, or -1 if out
+ * of memory, in which case cb is not called.
+ */
+static int
+async_submit(const char *url, const char *post, long ttl, int idempotent,
+    void (*cb)(struct json_object *, long, void *), void *arg)
+{
+	struct async *a;
+
+	if ((a = calloc(1, sizeof(struct async))) == NULL)
+		return -1;
+	if ((a->url = strdup(url)) == NULL ||
+	    (post != NULL && (a->post = strdup(post)) == NULL)) {
+		free(a->url);
+		free(a);
+		return -1;
+	}
+	a->ttl = ttl;
+	a->idempotent = idempotent;
+	a->cb = cb;
+	a->arg = arg;
+
+	pthread_mutex_lock(&looplock);
+	if (loopquit) {
+		pthread_mutex_unlock(&looplock);
+		async_done(a);
+		return 0;
+	}
+	if (lastsubmitted != NULL)
+		lastsubmitted->next = a;
+	else
+		submitted = a;
+	lastsubmitted = a;
+	/* with the lock held, curl_exit cannot free multi meanwhile */
+	curl_multi_wakeup(multi);
+	pthread_mutex_unlock(&looplock);
+	return 0;
+}
+
+/*
+ * Performs an API request and returns the parsed JSON response, or NULL if
+ * the request failed or the response is not valid JSON.  The request may
+ * change state on the server, so it is only tried again if it cannot have
+ * reached it.
+ */
+struct json_object *
+curl_fetch(const char *url, const char *post)
+{
+	return waitfetch(url, post, -1, 0);
+}
+
+/*
+ * Starts an API request and returns without waiting for it.  cb is called
+ * with the parsed response, or NULL, and the HTTP status once the request
+ * is done.  The status is 0 if there was no response, and -1 if the
+ * request could not be set up for lack of memory.  If ttl is not -1, the
+ * request is a GET whose response is cached as with curl_fetchcached,
+ * otherwise it is treated like curl_fetch.  cb runs on the event loop
+ * thread: it owns the response and must not block, nor wait for another
+ * request.  Returns 0, or -1 if out of memory, in which case cb is not
+ * called.
+ */
+int
+curl_fetchasync(const char *url, const char *post, long ttl,
+    void (*cb)(struct json_object *, long, void *), void *arg)
+{
+	return async_submit(url, post, ttl, ttl != -1, cb, arg);
+}
+
+/*
+ * Like curl_fetch, but for GET requests whose response may be reused.  A
+ * cached response younger than ttl seconds is returned without contacting
+ * the server.  An older one is revalidated with a conditional request and
+ * reused if the server replies with 304 Not Modified.
+ */
+struct json_object *
+curl_fetchcached(const char *url, long ttl)
+{
+	return waitfetch(url, NULL, ttl, 1);
+}
+
+/*
+ * Performs n GET requests concurrently, with at most maxconn of them in
+ * flight, and calls cb with the index and the parsed response of every
+ * request as it completes.  When ordered is set, the responses are passed
+ * to cb in the order of urls instead.  Responses are cached as with
+ * curl_fetchcached, unless ttl is -1.  Requests that fail for a transient
+ * reason are queued again after a delay.  cb owns the responses.  If out of
+ * memory, cb is passed NULL for every request.
+ */
+void
+curl_fetchmany(const char **urls, size_t n, int maxconn, int ordered,
+    long ttl, void (*cb)(size_t, struct json_object *, void *), void *arg)
+{
+	CURLM *multi;
+	CURLMsg *msg;
+	CURL *curl;
+	CURLcode result;
+	struct request *r, *p;
+	double *retryat, t, wait;
+	char *done;
+	int *tries;
+	size_t completed = 0, deliver = 0, i, next = 0, waiting = 0;
+	int nq, retry, running = 0, still;
+
+	if (n == 0)
+		return;
+	if (maxconn < 1)
+		maxconn = 1;
+	r = calloc(n, sizeof(struct request));
+	done = calloc(n, 1);
+	tries = calloc(n, sizeof(int));
+	retryat = calloc(n, sizeof(double));
+	multi = NULL;
+	if (r == NULL || done == NULL || tries == NULL || retryat == NULL ||
+	    (multi = curl_multi_init()) == NULL) {
+		for (i = 0; i < n; ++i)
+			cb(i, NULL, arg);
+		goto end;
+	}
+	/* several requests to one host can share an HTTP/2 connection */
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)maxconn);
+
+	/*
+	 * done[i] is 0 while a request is pending or in flight, 1 once it
+	 * completed, 2 once it was handed to cb and 3 while it waits to be
+	 * tried again.
+	 */
+	while (completed < n) {
+		t = monotime();
+		for (i = deliver; i < n && waiting > 0 && running < maxconn;
+		    ++i) {
+			if (done[i] != 3 || retryat[i] > t)
+				continue;
+			done[i] = 0;
+			waiting--;
+			if (request_init(&r[i], urls[i], NULL, ttl) != 0) {
+				done[i] = 1;
+				completed++;
+				continue;
+			}
+			curl_easy_setopt(r[i].curl, CURLOPT_PRIVATE, &r[i]);
+			curl_easy_setopt(r[i].curl, CURLOPT_PIPEWAIT, 1L);
+			curl_multi_add_handle(multi, r[i].curl);
+			running++;
+		}
+		while (running < maxconn && next < n) {
+			i = next++;
+			if (request_init(&r[i], urls[i], NULL, ttl) != 0) {
+				done[i] = 1;
+				completed++;
+				continue;
+			}
+			curl_easy_setopt(r[i].curl, CURLOPT_PRIVATE, &r[i]);
+			curl_easy_setopt(r[i].curl, CURLOPT_PIPEWAIT, 1L);
+			curl_multi_add_handle(multi, r[i].curl);
+			running++;
+		}
+
+		curl_multi_perform(multi, &still);
+		while ((msg = curl_multi_info_read(multi, &nq)) != NULL) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl = msg->easy_handle;
+			result = msg->data.result;
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&p);
+			curl_multi_remove_handle(multi, curl);
+			/* pooled handles are also used from other threads */
+			curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 0L);
+			i = p - r;
+			retry = tries[i] < RETRIES &&
+			    retryable(curl, result, 1);
+			request_finish(p, result);
+			running--;
+			if (retry) {
+				json_object_put(r[i].root);
+				r[i].root = NULL;
+				retryat[i] = monotime() + retrydelay(tries[i]++);
+				done[i] = 3;
+				waiting++;
+				pthread_mutex_lock(&statslock);
+				stats.retries++;
+				pthread_mutex_unlock(&statslock);
+				continue;
+			}
+			done[i] = 1;
+			completed++;
+		}
+
+		/* hand out what has completed, in order if asked to */
+		for (i = deliver; i < n; ++i) {
+			if ((done[i] == 0 || done[i] == 3) && ordered)
+				break;
+			if (done[i] != 1)
+				continue;
+			cb(i, r[i].root, arg);
+			done[i] = 2;
+		}
+		while (deliver < n && done[deliver] == 2)
+			deliver++;
+
+		/* wake up in time for the first retry that is due */
+		wait = 1000;
+		for (i = deliver, t = monotime(); i < n && waiting > 0; ++i) {
+			if (done[i] == 3 && retryat[i] - t < wait)
+				wait = retryat[i] > t ? retryat[i] - t : 0;
+		}
+		if (running > 0)
+			curl_multi_wait(multi, NULL, 0, (int)wait, NULL);
+		else if (waiting > 0)
+			msleep((long)wait);
+	}
+
+	curl_multi_cleanup(multi);
+end:
+	free(retryat);
+	free(tries);
+	free(done);
+	free(r);
+}
+
+/*
+ * Takes an idle handle from the pool, or sets up a new one when the pool is
+ * empty.  Options that are the same for every request are set only once.
+ * Returns NULL if the handle could not be set up.
+ */
+static CURL *
+curl_gethandle(void)
+{
+	CURL *curl = NULL;
+
+	pthread_mutex_lock(&poollock);
+	if (poolsize > 0)
+		curl = pool[--poolsize];
+	pthread_mutex_unlock(&poollock);
+	if (curl != NULL) {
+		if (setresolve(curl) == 0)
+			return curl;
+		curl_puthandle(curl);
+		return NULL;
+	}
+
+	if ((curl = curl_easy_init()) == NULL)
+		return NULL;
+	if (sethandle(curl) == -1 ||
+	    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header) != 0 ||
+	    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlwrite) != 0 ||
+	    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L) != 0 ||
+	    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)APITIMEOUT) != 0 ||
+	    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L) != 0) {
+		curl_easy_cleanup(curl);
+		return NULL;
+	}
+	/* HTTP/2 over TLS when the server offers it */
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+	    (long)CURL_HTTP_VERSION_2TLS);
+	return curl;
+}
+
+/*
+ * Copies up to n addresses the API server was reached at into hosts and
+ * returns how many were copied.
+ */
+size_t
+curl_gethosts(struct curlhost *h, size_t n)
+{
+	size_t i;
+
+	pthread_mutex_lock(&hostlock);
+	for (i = 0; i < n && i < nhosts; ++i)
+		h[i] = hosts[i];
+	pthread_mutex_unlock(&hostlock);
+	return i;
+}
+
+/*
+ * Returns the number of API requests made so far and what they cost.
+ */
+void
+curl_getstats(struct curlstats *s)
+{
+	pthread_mutex_lock(&statslock);
+	*s = stats;
+	pthread_mutex_unlock(&statslock);
+}
+
+/*
+ * Connects to host at the given address without looking up its name, until
+ * the address expires from the DNS cache or cannot be connected to.  Has to
+ * be called before the first request.
+ */
+void
+curl_pinhost(const struct curlhost *h)
+{
+	struct curl_slist *l;
+	char entry[sizeof(h->name) + sizeof(h->addr) + 24];
+
+	snprintf(entry, sizeof(entry), "+%s:%ld:%s", h->name, h->port,
+	    h->addr);
+	/* an address that cannot be pinned is looked up as usual */
+	if ((l = curl_slist_append(resolve, entry)) == NULL)
+		return;
+	resolve = l;
+	pthread_mutex_lock(&hostlock);
+	if (nhosts < MAXHOSTS)
+		hosts[nhosts++] = *h;
+	pthread_mutex_unlock(&hostlock);
+}
+
+static void
+curl_puthandle(CURL *curl)
+{
+	pthread_mutex_lock(&poollock);
+	if (poolsize < POOLSIZE) {
+		pool[poolsize++] = curl;
+		curl = NULL;
+	}
+	pthread_mutex_unlock(&poollock);
+	if (curl != NULL)
+		curl_easy_cleanup(curl);
+}
+
+/*
+ * Downloads url into fp, following redirects.  Unlike API requests, a failed
+ * download is not fatal.  Returns 0 on success and -1 on failure or when
+ * stop returned non-zero.
+ */
+int
+curl_save(const char *url, FILE *fp, int (*stop)(void *), void *arg)
+{
+	CURL *curl;
+	CURLcode n;
+	struct savestop ss = { .stop = stop, .arg = arg };
+	struct timing t;
+	off_t off;
+	int try;
+
+	/* a handle of its own, it still shares lookups and TLS sessions */
+	curl = curl_easy_init();
+	if (curl == NULL)
+		return -1;
+	if (sethandle(curl) == -1 ||
+	    curl_easy_setopt(curl, CURLOPT_URL, url) != 0 ||
+	    curl_easy_setopt(curl, CURLOPT_USERAGENT, USERAGENT) != 0 ||
+	    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L) != 0 ||
+	    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L) != 0 ||
+	    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L) != 0 ||
+	    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp) != 0) {
+		curl_easy_cleanup(curl);
+		return -1;
+	}
+	if (stop != NULL) {
+		curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, savestop);
+		curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &ss);
+		curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+	}
+
+	/*
+	 * A transfer that breaks off is resumed from the last byte that was
+	 * written, or started over if the server cannot send a range.
+	 */
+	for (try = 0;; ++try) {
+		if (fflush(fp) != 0 || (off = ftello(fp)) == -1) {
+			n = CURLE_WRITE_ERROR;
+			break;
+		}
+		curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE,
+		    (curl_off_t)off);
+		n = curl_easy_perform(curl);
+		gettiming(curl, n, &t);
+		stats_request("audio", &t);
+		if (n == CURLE_OK || try == RETRIES ||
+		    (stop != NULL && stop(arg)))
+			break;
+		if (n == CURLE_RANGE_ERROR || n == CURLE_BAD_DOWNLOAD_RESUME) {
+			if (fflush(fp) != 0 || ftruncate(fileno(fp), 0) == -1)
+				break;
+			rewind(fp);
+		} else if (!retryable(curl, n, 1))
+			break;
+		pthread_mutex_lock(&statslock);
+		stats.retries++;
+		pthread_mutex_unlock(&statslock);
+		msleep(retrydelay(try));
+	}
+	curl_easy_cleanup(curl);
+	return n == CURLE_OK ? 0 : -1;
+}
+
+/*
+ * Remembers the alternative services servers announce in the file at path,
+ * so that they are used from the first request of the next run.  Has to be
+ * called before the first request.
+ */
+void
+curl_setaltsvc(const char *path)
+{
+	free(altsvc);
+	/* without memory for the path, the services are not remembered */
+	altsvc = strdup(path);
+}
+
+/*
+ * Picks the cache validators out of the response headers.
+ */
+static size_t
+curlheader(char *buf, size_t size, size_t nmemb, void *arg)
+{
+	struct response *r = arg;
+	size_t len;
+
+	len = size * nmemb;
+	if (len > 5 && strncasecmp(buf, "ETag:", 5) == 0) {
+		free(r->etag);
+		r->etag = headerdup(buf + 5, len - 5);
+	} else if (len > 14 && strncasecmp(buf, "Last-Modified:", 14) == 0) {
+		free(r->lastmodified);
+		r->lastmodified = headerdup(buf + 14, len - 14);
+	}
+	return len;
+}
+
 static size_t
 curlwrite(void *contents, size_t size, size_t nmemb, void *stream)
 {
-	struct curlbuf *b;
+	struct request *r;
+	enum json_tokener_error jerr;
 	size_t total;
 
 	total = size * nmemb;
 	if (total == 0)
 		return 0;
 
-	b = (struct curlbuf *)stream;
-	b->data = realloc(b->data, b->pos + total + 1);
-	if (b->data == NULL)
-		err(1, NULL);
-	memcpy(&(b->data[b->pos]), contents, total);
-	b->pos += total;
-	b->data[b->pos] = '\0';
+	r = (struct request *)stream;
+	if (r->copy) {
+		/* the validators are known once the body starts */
+		if (r->cache.fp == NULL &&
+		    cache_beginresponse(&r->cache, r->url, &r->resp) == -1)
+			r->copy = 0;
+		else
+			fwrite(contents, 1, total, r->cache.fp);
+	}
+	if (r->done)
+		return total;
+
+	r->root = json_tokener_parse_ex(r->tok, contents, (int)total);
+	jerr = json_tokener_get_error(r->tok);
+	if (r->root != NULL || jerr != json_tokener_continue)
+		r->done = 1;
 	return total;
 }
 
-char *
-curl_fetch(const char *url, const char *post)
+/*
+ * Names the API endpoint of url for the statistics.  Play tokens, mix paths
+ * and query strings are left out, so that requests to the same endpoint
+ * are counted together, e.g. "sets/next" or "mix_sets".
+ */
+static void
+endpoint(const char *url, char *buf, size_t size)
+{
+	const char *p, *q;
+
+	if (strstr(url, "/mix_sets/") != NULL)
+		snprintf(buf, size, "mix_sets");
+	else if ((p = strstr(url, "/sets/")) != NULL) {
+		p += strlen("/sets/");
+		/* sets/new has no token, the others are sets/<token>/name */
+		if ((q = strchr(p, '/')) != NULL)
+			p = q + 1;
+		snprintf(buf, size, "sets/%.*s", (int)strcspn(p, "?"), p);
+	} else
+		snprintf(buf, size, "mix");
+}
+
+/*
+ * Collects the phases of a finished transfer.
+ */
+static void
+gettiming(CURL *curl, CURLcode n, struct timing *t)
+{
+	curl_off_t size = 0;
+
+	memset(t, 0, sizeof(*t));
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &t->namelookup);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &t->connect);
+	curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &t->appconnect);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME,
+	    &t->starttransfer);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &t->total);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &size);
+	t->bytes = (unsigned long long)size;
+	t->failed = n != CURLE_OK;
+}
+
+/*
+ * Returns a copy of a header value without surrounding white space, or
+ * NULL if out of memory.
+ */
+static char *
+headerdup(const char *s, size_t len)
+{
+	char *p;
+
+	while (len > 0 && (*s == ' ' || *s == '\t')) {
+		s++;
+		len--;
+	}
+	while (len > 0 && (s[len - 1] == '\r' || s[len - 1] == '\n' ||
+	    s[len - 1] == ' ' || s[len - 1] == '\t'))
+		len--;
+	if ((p = malloc(len + 1)) == NULL)
+		return NULL;
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return p;
+}
+
+/*
+ * Remembers the address the API server of url was reached at.  An address
+ * that is already known keeps the time it was first used, so a pinned
+ * address expires even if it keeps working.
+ */
+static void
+learnhost(CURL *curl, const char *url)
 {
+	struct curlhost h;
+	char *addr = NULL;
+	size_t i;
+
+	if (curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &addr) != CURLE_OK ||
+	    addr == NULL || *addr == '\0' ||
+	    curl_easy_getinfo(curl, CURLINFO_PRIMARY_PORT, &h.port) !=
+	    CURLE_OK || urlhost(url, h.name, sizeof(h.name)) == -1 ||
+	    strlen(addr) >= sizeof(h.addr))
+		return;
+	/* literal addresses need no lookup */
+	if (strcmp(h.name, addr) == 0)
+		return;
+	snprintf(h.addr, sizeof(h.addr), "%s", addr);
+	h.seen = time(NULL);
+
+	pthread_mutex_lock(&hostlock);
+	for (i = 0; i < nhosts; ++i)
+		if (strcmp(hosts[i].name, h.name) == 0 &&
+		    hosts[i].port == h.port)
+			break;
+	if (i < nhosts && strcmp(hosts[i].addr, h.addr) == 0)
+		h.seen = hosts[i].seen;
+	if (i < MAXHOSTS) {
+		hosts[i] = h;
+		if (i == nhosts)
+			nhosts++;
+	}
+	pthread_mutex_unlock(&hostlock);
+}
+
+/*
+ * The event loop.  It starts the requests that were submitted and those
+ * that are due to be retried, and completes the ones that are done.
+ * Requests to the same host share an HTTP/2 connection where possible.
+ * Whatever is left when curl_exit stops the loop fails.  A request that
+ * may change state on the server is only retried if it cannot have
+ * reached it, as with curl_fetch.
+ */
+static void *
+loop(void *arg)
+{
+	struct async *a, *active = NULL, *next, **pa, *retry = NULL;
+	CURLMsg *msg;
 	CURL *curl;
-	CURLcode n;
-	struct curl_slist *header;
-	struct curlbuf buf = {.data = NULL, .pos = 0 };
+	CURLcode result;
+	double t, wait;
+	int nq, quit, still, again;
 
-	curl = curl_easy_init();
-	if (curl == NULL)
-		errx(1, "curl_easy_init failed");
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&looplock);
+		a = submitted;
+		submitted = lastsubmitted = NULL;
+		quit = loopquit;
+		pthread_mutex_unlock(&looplock);
+		if (quit) {
+			/* fail what was submitted with the rest */
+			for (; a != NULL; a = next) {
+				next = a->next;
+				a->next = retry;
+				retry = a;
+			}
+			break;
+		}
+		for (; a != NULL; a = next) {
+			next = a->next;
+			async_start(a, &active);
+		}
+		t = monotime();
+		for (pa = &retry; *pa != NULL;) {
+			a = *pa;
+			if (a->retryat > t) {
+				pa = &a->next;
+				continue;
+			}
+			*pa = a->next;
+			async_start(a, &active);
+		}
 
-	header = curl_slist_append(NULL, "X-Api-Key: " APIKEY);
-	header = curl_slist_append(header, "X-Api-Version: 3");
-	header = curl_slist_append(header, "User-Agent: " USERAGENT);
-	header = curl_slist_append(header, "Accept: application/json");
-	if (header == NULL)
-		errx(1, "curl: set header failed");
+		curl_multi_perform(multi, &still);
+		while ((msg = curl_multi_info_read(multi, &nq)) != NULL) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl = msg->easy_handle;
+			result = msg->data.result;
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&a);
+			curl_multi_remove_handle(multi, curl);
+			curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 0L);
+			if (a->prev != NULL)
+				a->prev->next = a->next;
+			else
+				active = a->next;
+			if (a->next != NULL)
+				a->next->prev = a->prev;
+			again = a->tries < RETRIES &&
+			    retryable(curl, result, a->idempotent);
+			request_finish(&a->r, result);
+			if (!again) {
+				async_done(a);
+				continue;
+			}
+			json_object_put(a->r.root);
+			a->retryat = monotime() + retrydelay(a->tries++);
+			a->next = retry;
+			retry = a;
+			pthread_mutex_lock(&statslock);
+			stats.retries++;
+			pthread_mutex_unlock(&statslock);
+		}
 
-	if (curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header) != 0 ||
-	    curl_easy_setopt(curl, CURLOPT_URL, url) != 0 ||
-	    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlwrite) != 0 ||
-	    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&buf) != 0)
-		errx(1, "curl_easy_setopt failed");
-	if (post != NULL &&
-	    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post) != 0)
-		errx(1, "curl_easy_setopt failed");
+		/* wake up in time for the first retry that is due */
+		wait = 1000;
+		for (a = retry, t = monotime(); a != NULL; a = a->next)
+			if (a->retryat - t < wait)
+				wait = a->retryat > t ? a->retryat - t : 0;
+		curl_multi_poll(multi, NULL, 0, (int)wait, NULL);
+	}
 
-	n = curl_easy_perform(curl);
-	if (n != CURLE_OK)
-		errx(1, "curl_easy_perform, error: %s", curl_easy_strerror(n));
+	for (; active != NULL; active = next) {
+		next = active->next;
+		curl_multi_remove_handle(multi, active->r.curl);
+		curl_easy_setopt(active->r.curl, CURLOPT_PIPEWAIT, 0L);
+		request_finish(&active->r, CURLE_ABORTED_BY_CALLBACK);
+		async_done(active);
+	}
+	for (; retry != NULL; retry = next) {
+		next = retry->next;
+		retry->r.root = NULL;
+		retry->r.status = 0;
+		async_done(retry);
+	}
+	return NULL;
+}
 
-	curl_easy_cleanup(curl);
-	curl_slist_free_all(header);
-	return buf.data;
+/* Returns the time in milliseconds on a clock that only moves forward. */
+static double
+monotime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void
+msleep(long ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = ms % 1000 * 1000000;
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * Takes care of a finished transfer: checks the result, updates the cache
+ * and returns the handle to the pool.  The response is left in r->root.
+ */
+static void
+request_finish(struct request *r, CURLcode n)
+{
+	long code = 0;
+
+	addstats(r->curl, r->url, n);
+	if (n == CURLE_OK) {
+		curl_easy_getinfo(r->curl, CURLINFO_RESPONSE_CODE, &code);
+		learnhost(r->curl, r->url);
+	} else {
+		if (n == CURLE_COULDNT_CONNECT || n == CURLE_OPERATION_TIMEDOUT)
+			unpinhost(r->curl, r->url);
+		/* the caller decides whether a failed request is fatal */
+		json_object_put(r->root);
+		r->root = NULL;
+	}
+	cache_endresponse(&r->cache, code == 200 && r->root != NULL);
+	r->status = code;
+
+	if (r->stale && code == 304) {
+		json_object_put(r->root);
+		r->root = json_tokener_parse(r->cached.body);
+		/* a 304 may leave out validators that did not change */
+		if (r->resp.etag == NULL) {
+			r->resp.etag = r->cached.etag;
+			r->cached.etag = NULL;
+		}
+		if (r->resp.lastmodified == NULL) {
+			r->resp.lastmodified = r->cached.lastmodified;
+			r->cached.lastmodified = NULL;
+		}
+		r->resp.body = r->cached.body;
+		r->cached.body = NULL;
+		cache_saveresponse(r->url, &r->resp);
+		r->status = 200;
+	}
+	cache_freeresponse(&r->cached);
+	cache_freeresponse(&r->resp);
+
+	/* leave the pooled handle as curl_gethandle set it up */
+	curl_easy_setopt(r->curl, CURLOPT_HTTPHEADER, header);
+	curl_easy_setopt(r->curl, CURLOPT_HEADERFUNCTION, NULL);
+	curl_easy_setopt(r->curl, CURLOPT_HEADERDATA, NULL);
+	curl_puthandle(r->curl);
+	r->curl = NULL;
+	if (r->hdr != header)
+		curl_slist_free_all(r->hdr);
+	json_tokener_free(r->tok);
+}
+
+/*
+ * Prepares a request.  Returns 1 if the response was served from the cache
+ * and is in r->root, 0 if r->curl is ready to be performed, or -1 if the
+ * request could not be set up for lack of memory, which sets r->status to
+ * -1.
+ */
+static int
+request_init(struct request *r, const char *url, const char *post, long ttl)
+{
+	const struct response *c = &r->cached;
+	struct curl_slist *h;
+	char *line;
+	size_t len;
+	int n = 0;
+
+	r->url = url;
+	r->curl = NULL;
+	r->tok = NULL;
+	r->hdr = header;
+	r->root = NULL;
+	r->status = 0;
+	r->done = 0;
+	r->ttl = ttl;
+	r->copy = ttl >= 0;
+	r->stale = 0;
+	r->cache.fp = NULL;
+	r->cached.body = r->cached.etag = r->cached.lastmodified = NULL;
+	r->resp.body = r->resp.etag = r->resp.lastmodified = NULL;
+	r->resp.expires = time(NULL) + ttl;
+
+	if (ttl >= 0 && cache_loadresponse(url, &r->cached) == 0) {
+		if (c->expires > time(NULL)) {
+			r->root = json_tokener_parse(c->body);
+			r->status = 200;
+			cache_freeresponse(&r->cached);
+			pthread_mutex_lock(&statslock);
+			stats.cached++;
+			pthread_mutex_unlock(&statslock);
+			return 1;
+		}
+		r->stale = 1;
+	}
+	if (r->stale && (c->etag != NULL || c->lastmodified != NULL)) {
+		r->hdr = NULL;
+		for (h = header; h != NULL && n == 0; h = h->next)
+			n = slistadd(&r->hdr, h->data);
+		len = strlen("If-Modified-Since: ") +
+		    (c->lastmodified ? strlen(c->lastmodified) : 0) +
+		    strlen("If-None-Match: ") +
+		    (c->etag ? strlen(c->etag) : 0) + 1;
+		if (n == -1 || (line = malloc(len)) == NULL)
+			goto fail;
+		if (c->etag != NULL) {
+			snprintf(line, len, "If-None-Match: %s", c->etag);
+			n = slistadd(&r->hdr, line);
+		}
+		if (n == 0 && c->lastmodified != NULL) {
+			snprintf(line, len, "If-Modified-Since: %s",
+			    c->lastmodified);
+			n = slistadd(&r->hdr, line);
+		}
+		free(line);
+		if (n == -1)
+			goto fail;
+	}
+	if ((r->tok = json_tokener_new()) == NULL ||
+	    (r->curl = curl_gethandle()) == NULL)
+		goto fail;
+
+	/* the options that copy a string can run out of memory */
+	if (curl_easy_setopt(r->curl, CURLOPT_URL, url) != 0 ||
+	    curl_easy_setopt(r->curl, CURLOPT_HTTPHEADER, r->hdr) != 0 ||
+	    curl_easy_setopt(r->curl, CURLOPT_WRITEDATA, (void *)r) != 0)
+		goto fail;
+	if (post != NULL) {
+		if (curl_easy_setopt(r->curl, CURLOPT_POSTFIELDS, post) != 0)
+			goto fail;
+	} else if (curl_easy_setopt(r->curl, CURLOPT_HTTPGET, 1L) != 0)
+		goto fail;
+	if (ttl >= 0 && (curl_easy_setopt(r->curl, CURLOPT_HEADERFUNCTION,
+	    curlheader) != 0 ||
+	    curl_easy_setopt(r->curl, CURLOPT_HEADERDATA, &r->resp) != 0))
+		goto fail;
+	return 0;
+
+fail:
+	/* a handle that was half set up is not put back in the pool */
+	if (r->curl != NULL)
+		curl_easy_cleanup(r->curl);
+	r->curl = NULL;
+	if (r->hdr != header)
+		curl_slist_free_all(r->hdr);
+	r->hdr = header;
+	if (r->tok != NULL)
+		json_tokener_free(r->tok);
+	r->tok = NULL;
+	cache_freeresponse(&r->cached);
+	r->status = -1;
+	return -1;
+}
+
+/*
+ * Keeps a list that handles may still point to until curl_exit.  Called
+ * with hostlock held.
+ */
+static void
+retire(struct curl_slist *l)
+{
+	struct curl_slist *last;
+
+	if (retired == NULL) {
+		retired = l;
+		return;
+	}
+	for (last = retired; last->next != NULL; last = last->next)
+		continue;
+	last->next = l;
+}
+
+/*
+ * Returns the number of milliseconds to wait before retry number try + 1:
+ * half of a doubling delay plus a random part of the other half, so that
+ * clients that failed together do not all come back at the same time.
+ */
+static long
+retrydelay(int try)
+{
+	struct timespec ts;
+	unsigned int seed;
+	long delay;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	seed = (unsigned int)ts.tv_nsec;
+	delay = (long)RETRYMIN << try;
+	return delay / 2 + rand_r(&seed) % (delay / 2 + 1);
+}
+
+/*
+ * Returns whether a request that ended with n is worth trying again.  A
+ * request that failed before it was sent is always tried again, others
+ * only if idempotent is set and the failure looks transient: a timeout, a
+ * broken connection, or a server that is overloaded or briefly down.
+ */
+static int
+retryable(CURL *curl, CURLcode n, int idempotent)
+{
+	double connect = 0;
+	long code = 0;
+
+	switch (n) {
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+		return 1;
+	case CURLE_OPERATION_TIMEDOUT:
+		curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+		return connect == 0 || idempotent;
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_PARTIAL_FILE:
+	case CURLE_HTTP2:
+	case CURLE_HTTP2_STREAM:
+	case CURLE_SSL_CONNECT_ERROR:
+		return idempotent;
+	case CURLE_OK:
+	case CURLE_HTTP_RETURNED_ERROR:
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+		return idempotent && (code == 429 || code >= 500);
+	default:
+		return 0;
+	}
+}
+
+static int
+savestop(void *arg, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+    curl_off_t ulnow)
+{
+	struct savestop *ss = arg;
+
+	(void)dltotal;
+	(void)dlnow;
+	(void)ultotal;
+	(void)ulnow;
+	return ss->stop(ss->arg);
+}
+
+/*
+ * Sets the options shared by API and download handles.  Returns 0 on
+ * success and -1 on failure.
+ */
+static int
+sethandle(CURL *curl)
+{
+	if (curl_easy_setopt(curl, CURLOPT_SHARE, share) != 0 ||
+	    setresolve(curl) == -1)
+		return -1;
+	/* give up on a server that does not answer or stops sending */
+	if (curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT,
+	    (long)CONNECTTIMEOUT) != 0 ||
+	    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L) != 0 ||
+	    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)STALLTIME) != 0)
+		return -1;
+	/* not every libcurl is built with alt-svc support */
+	if (altsvc != NULL)
+		curl_easy_setopt(curl, CURLOPT_ALTSVC, altsvc);
+	return 0;
+}
+
+/*
+ * Hands the pinned addresses to a handle, or, once, the addresses to drop
+ * from the DNS cache along with them.  Returns 0 on success and -1 on
+ * failure.
+ */
+static int
+setresolve(CURL *curl)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&hostlock);
+	if (unresolve != NULL) {
+		if (curl_easy_setopt(curl, CURLOPT_RESOLVE, unresolve) != 0)
+			n = -1;
+		else {
+			retire(unresolve);
+			unresolve = NULL;
+		}
+	} else if (curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve) != 0)
+		n = -1;
+	pthread_mutex_unlock(&hostlock);
+	return n;
+}
+
+static void
+sharedolock(CURL *curl, curl_lock_data data, curl_lock_access access,
+    void *arg)
+{
+	(void)curl;
+	(void)access;
+	(void)arg;
+	pthread_mutex_lock(&sharelock[data]);
+}
+
+static void
+shareunlock(CURL *curl, curl_lock_data data, void *arg)
+{
+	(void)curl;
+	(void)arg;
+	pthread_mutex_unlock(&sharelock[data]);
+}
+
+/*
+ * Unpins the address of the API server of url after a connection to it
+ * could not be made.  It is no longer handed to handles, nor kept for the
+ * next run, and the next handle drops it from the DNS cache, so that a
+ * retry looks the name up.
+ */
+/*
+ * Appends a copy of s to the list *l.  Returns 0 on success and -1 if out
+ * of memory, which leaves the list as it was.
+ */
+static int
+slistadd(struct curl_slist **l, const char *s)
+{
+	struct curl_slist *n;
+
+	if ((n = curl_slist_append(*l, s)) == NULL)
+		return -1;
+	*l = n;
+	return 0;
+}
+
+static void
+unpinhost(CURL *curl, const char *url)
+{
+	struct curl_slist *keep = NULL, *drop = NULL, *l;
+	char name[sizeof(hosts[0].name)], entry[sizeof(name) + 24];
+	char *addr = NULL, *p;
+	double connect = 0;
+	size_t i, len;
+
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+	if (connect > 0 || urlhost(url, name, sizeof(name)) == -1)
+		return;
+	curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &addr);
+	if (addr != NULL && *addr == '\0')
+		addr = NULL;
+	len = strlen(name);
+
+	/*
+	 * The entries are +name:port:address, dropping one is -name:port.
+	 * Without the memory to drop an address, it stays pinned.
+	 */
+	pthread_mutex_lock(&hostlock);
+	for (l = resolve; l != NULL; l = l->next) {
+		p = l->data;
+		if (strncmp(p + 1, name, len) == 0 && p[len + 1] == ':' &&
+		    (p = strchr(p + len + 2, ':')) != NULL &&
+		    (addr == NULL || strcmp(p + 1, addr) == 0)) {
+			snprintf(entry, sizeof(entry), "-%.*s",
+			    (int)(p - l->data - 1), l->data + 1);
+			if (slistadd(&drop, entry) == -1)
+				goto end;
+		} else if (slistadd(&keep, l->data) == -1)
+			goto end;
+	}
+	if (drop == NULL)
+		goto end;
+	/* what is still pinned goes along with what is dropped */
+	for (l = keep; l != NULL; l = l->next)
+		if (slistadd(&drop, l->data) == -1)
+			goto end;
+	for (l = unresolve; l != NULL; l = l->next)
+		if (*l->data == '-' && slistadd(&drop, l->data) == -1)
+			goto end;
+	retire(resolve);
+	resolve = keep;
+	curl_slist_free_all(unresolve);
+	unresolve = drop;
+	keep = drop = NULL;
+
+	for (i = 0; i < nhosts;)
+		if (strcmp(hosts[i].name, name) == 0 &&
+		    (addr == NULL || strcmp(hosts[i].addr, addr) == 0))
+			hosts[i] = hosts[--nhosts];
+		else
+			i++;
+end:
+	pthread_mutex_unlock(&hostlock);
+	curl_slist_free_all(keep);
+	curl_slist_free_all(drop);
+}
+
+/*
+ * Copies the host name of url to name.  Returns 0 on success and -1 if url
+ * has no host name, or one that does not fit.
+ */
+static int
+urlhost(const char *url, char *name, size_t size)
+{
+	const char *p;
+	size_t len;
+
+	if ((p = strstr(url, "://")) == NULL)
+		return -1;
+	p += 3;
+	len = strcspn(p, ":/?");
+	if (*p == '[' || len == 0 || len >= size)
+		return -1;
+	memcpy(name, p, len);
+	name[len] = '\0';
+	return 0;
 }
 
+/*
+ * Completes a blocking request.
+ */
+static void
+waitdone(struct json_object *root, long status, void *arg)
+{
+	struct wait *w = arg;
+
+	(void)status;
+	pthread_mutex_lock(&w->lock);
+	w->root = root;
+	w->done = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Hands a request to the event loop and waits for the response.
+ */
+static struct json_object *
+waitfetch(const char *url, const char *post, long ttl, int idempotent)
+{
+	struct wait w = { .done = 0, .root = NULL };
+
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	if (async_submit(url, post, ttl, idempotent, waitdone, &w) == 0) {
+		pthread_mutex_lock(&w.lock);
+		while (!w.done)
+			pthread_cond_wait(&w.cond, &w.lock);
+		pthread_mutex_unlock(&w.lock);
+	}
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.lock);
+	return w.root;
+}
@@ -16,12 +16,42 @@
 #ifndef CURL_H
 #define CURL_H
 
+#define MAXHOSTS	4	/* addresses remembered for the next run */
+
+struct curlstats {
+	unsigned long		requests;	/* sent to the server */
+	unsigned long		failed;
+	unsigned long		retries;	/* after a transient failure */
+	unsigned long		cached;		/* answered by the cache */
+	double			time;		/* seconds spent in requests */
+	unsigned long long	bytes;		/* received */
+};
+
+/* an address the API server was reached at */
+struct curlhost {
+	char	name[256];
+	long	port;
+	char	addr[46];
+	time_t	seen;		/* when the address was first used */
+};
+
 __BEGIN_DECLS
 
 void	curl_init(void);
 void	curl_exit(void);
 
-char	*curl_fetch(const char *url, const char *post);
+struct	json_object *curl_fetch(const char *url, const char *post);
+int	curl_fetchasync(const char *url, const char *post, long ttl,
+    void (*cb)(struct json_object *root, long status, void *arg), void *arg);
+struct	json_object *curl_fetchcached(const char *url, long ttl);
+void	curl_fetchmany(const char **urls, size_t n, int maxconn, int ordered,
+    long ttl, void (*cb)(size_t i, struct json_object *root, void *arg),
+    void *arg);
+size_t	curl_gethosts(struct curlhost *hosts, size_t n);
+void	curl_getstats(struct curlstats *stats);
+void	curl_pinhost(const struct curlhost *host);
+int	curl_save(const char *url, FILE *fp, int (*stop)(void *), void *arg);
+void	curl_setaltsvc(const char *path);
 
 __END_DECLS
 
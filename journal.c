@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2015 Johannes Postma <jgmpostma@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Play reports are queued and sent by a background thread, so playback
+ * never waits for the network.  Reports that do not reach the server are
+ * retried with an exponential, jittered backoff, for up to REPORTAGE after
+ * they were queued.  A report that the server refuses, for instance for an
+ * expired play token, is dropped.
+ *
+ * Every queued report is appended to a journal as an "R" line, and every
+ * report that is done with as a "D" line:
+ *
+ *	R <seq> <trackid> <mixid> <playtoken> <time queued>
+ *	D <seq>
+ *
+ * Reports left unsent by an earlier run, or by a crash, are sent by the
+ * next run.  The journal is compacted to the unsent reports on startup.
+ */
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "8tracks.h"
+#include "cache.h"
+#include "journal.h"
+
+#define BACKOFFMIN	1	/* seconds */
+#define BACKOFFMAX	300
+#define REPORTAGE	(24 * 60 * 60)	/* seconds a report is retried */
+
+struct pending {
+	struct pending	*next;
+	unsigned long	 seq;
+	int		 trackid;
+	int		 mixid;
+	char		*playtoken;
+	time_t		 queued;
+};
+
+static struct pending	*head, **tail = &head;
+static unsigned long	 seq;
+static int		 fd = -1;	/* journal, opened for appending */
+static int		 lockfd = -1;
+static int		 quitflag;
+static pthread_t	 thread;
+static int		 running;
+static int		 sending;	/* a report is in flight */
+static pthread_mutex_t	 lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 cond;
+
+static int	 enqueue(unsigned long, int, int, const char *, time_t);
+static int	 load(const char *);
+static void	*sender(void *);
+
+void
+journal_init(void)
+{
+	pthread_condattr_t attr;
+	char *dir, *path, *tmp;
+	struct pending *p;
+	size_t len;
+	int n, tmpfd;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/*
+	 * Without a journal, or when another instance holds it, reports are
+	 * still sent, they are only not kept across runs.
+	 */
+	if ((dir = cache_dir("journal")) == NULL)
+		goto start;
+	len = strlen(dir) + strlen("/reports.tmp") + 1;
+	if ((path = malloc(len)) == NULL || (tmp = malloc(len)) == NULL)
+		err(1, NULL);
+	snprintf(path, len, "%s/lock", dir);
+	lockfd = open(path, O_RDWR | O_CREAT, 0600);
+	if (lockfd == -1 || lockf(lockfd, F_TLOCK, 0) == -1) {
+		if (lockfd != -1)
+			close(lockfd);
+		lockfd = -1;
+		goto end;
+	}
+
+	snprintf(path, len, "%s/reports", dir);
+	snprintf(tmp, len, "%s/reports.tmp", dir);
+
+	/* compact: keep only what has not been sent, unless some was lost */
+	if (load(path) == -1) {
+		fd = open(path, O_WRONLY | O_APPEND);
+		goto end;
+	}
+	tmpfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (tmpfd == -1)
+		goto end;
+	for (p = head; p != NULL; p = p->next)
+		dprintf(tmpfd, "R %lu %d %d %s %lld\n", p->seq, p->trackid,
+		    p->mixid, p->playtoken, (long long)p->queued);
+	n = fsync(tmpfd);
+	close(tmpfd);
+	if (n == -1 || rename(tmp, path) == -1) {
+		unlink(tmp);
+		goto end;
+	}
+	fd = open(path, O_WRONLY | O_APPEND);
+end:
+	free(tmp);
+	free(path);
+	free(dir);
+start:
+	n = pthread_create(&thread, NULL, sender, NULL);
+	if (n != 0)
+		errx(1, "pthread_create: %s", strerror(n));
+	running = 1;
+}
+
+/*
+ * Stops the sender.  The reports that have not been sent stay in the
+ * journal for the next run.  A report that is being sent is not waited
+ * for: the sender is left to finish it on its own, and keeps the queue.
+ */
+void
+journal_exit(void)
+{
+	struct pending *p;
+	int busy;
+
+	if (!running)
+		return;
+	pthread_mutex_lock(&lock);
+	quitflag = 1;
+	busy = sending;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	running = 0;
+	if (busy) {
+		pthread_detach(thread);
+		return;
+	}
+	pthread_join(thread, NULL);
+
+	while ((p = head) != NULL) {
+		head = p->next;
+		free(p->playtoken);
+		free(p);
+	}
+	tail = &head;
+	if (fd != -1)
+		close(fd);
+	if (lockfd != -1)
+		close(lockfd);
+	fd = lockfd = -1;
+	pthread_cond_destroy(&cond);
+}
+
+/*
+ * Queues a play report.  Does not block on the network.  A report that
+ * cannot be queued for lack of memory is still written to the journal, for
+ * the next run to send.
+ */
+void
+journal_report(int trackid, int mixid, const char *playtoken)
+{
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&lock);
+	enqueue(++seq, trackid, mixid, playtoken, now);
+	if (fd != -1)
+		dprintf(fd, "R %lu %d %d %s %lld\n", seq, trackid, mixid,
+		    playtoken, (long long)now);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Adds a report to the queue.  Returns 0 on success and -1 if out of
+ * memory.
+ */
+static int
+enqueue(unsigned long n, int trackid, int mixid, const char *playtoken,
+    time_t queued)
+{
+	struct pending *p;
+
+	if ((p = malloc(sizeof(struct pending))) == NULL)
+		return -1;
+	if ((p->playtoken = strdup(playtoken)) == NULL) {
+		free(p);
+		return -1;
+	}
+	p->next = NULL;
+	p->seq = n;
+	p->trackid = trackid;
+	p->mixid = mixid;
+	p->queued = queued;
+	*tail = p;
+	tail = &p->next;
+	return 0;
+}
+
+/*
+ * Queues the reports in the journal that were never marked as done.  A
+ * report written without the time it was queued counts as queued now.
+ * Returns -1 if a report could not be queued for lack of memory, and 0
+ * otherwise.
+ */
+static int
+load(const char *path)
+{
+	FILE *fp;
+	struct pending *p, **pp;
+	char line[256], token[128];
+	unsigned long n;
+	long long queued;
+	int mixid, ret = 0, trackid;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		queued = time(NULL);
+		if (sscanf(line, "R %lu %d %d %127s %lld", &n, &trackid,
+		    &mixid, token, &queued) >= 4) {
+			if (enqueue(n, trackid, mixid, token,
+			    (time_t)queued) == -1)
+				ret = -1;
+		} else if (sscanf(line, "D %lu", &n) == 1) {
+			for (pp = &head; (p = *pp) != NULL; pp = &p->next) {
+				if (p->seq != n)
+					continue;
+				*pp = p->next;
+				if (tail == &p->next)
+					tail = pp;
+				free(p->playtoken);
+				free(p);
+				break;
+			}
+		} else
+			continue;
+		if (n > seq)
+			seq = n;
+	}
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * Sends the queued reports in order, one after the other over the same
+ * connection, and backs off while the server cannot be reached.
+ */
+static void *
+sender(void *arg)
+{
+	struct pending *p;
+	struct timespec ts;
+	unsigned int seed;
+	int backoff = BACKOFFMIN, delay, n;
+
+	(void)arg;
+	seed = (unsigned int)time(NULL);
+	pthread_mutex_lock(&lock);
+	while (!quitflag) {
+		if ((p = head) == NULL) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		/* a report that is too old is not worth sending any more */
+		n = 1;
+		if (time(NULL) - p->queued < REPORTAGE) {
+			sending = 1;
+			pthread_mutex_unlock(&lock);
+			n = report(p->trackid, p->mixid, p->playtoken);
+			pthread_mutex_lock(&lock);
+			sending = 0;
+			if (n != -1)
+				backoff = BACKOFFMIN;
+		}
+
+		/* sent, refused or expired, it is done with */
+		if (n != -1) {
+			if (fd != -1)
+				dprintf(fd, "D %lu\n", p->seq);
+			if ((head = p->next) == NULL)
+				tail = &head;
+			free(p->playtoken);
+			free(p);
+			continue;
+		}
+
+		/* wait half to all of the backoff, then try again */
+		delay = backoff * 1000 / 2 + rand_r(&seed) % (backoff * 500 + 1);
+		if (backoff < BACKOFFMAX)
+			backoff = backoff * 2 < BACKOFFMAX ? backoff * 2 :
+			    BACKOFFMAX;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += delay / 1000;
+		ts.tv_nsec += (delay % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while (!quitflag &&
+		    pthread_cond_timedwait(&cond, &lock, &ts) == 0)
+			;
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
@@ -13,128 +13,521 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
-#include <sys/select.h>
+#include <sys/resource.h>
+
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "8tracks.h"
+#include "cache.h"
+#include "control.h"
 #include "curl.h"
+#include "journal.h"
+#include "state.h"
+#include "stats.h"
 #include "libplayer/player.h"
 
+#define REPORTTIME	30	/* seconds played before a track is reported */
+#define POLLMIN		50	/* shortest wait for input while playing, ms */
+#define JOBS		4	/* default number of concurrent requests */
+
+/* keys posted by the control socket, beyond what a terminal can send */
+#define KEYPLAY		0x100	/* play the mix in now.url */
+#define KEYSTOP		0x101
+
 enum playcmd {
 	NEXT,
 	SKIP,
 	SKIPMIX
 };
 
+/*
+ * The next track of a mix is fetched in the background while the current
+ * one is still playing, so the track transition does not have to wait for
+ * the API round trip.  After the track is known, the worker goes on to
+ * download its stream into the track cache.  During the last track of a
+ * mix in continuous play, the worker looks up the similar mix that comes
+ * next and fetches its first track instead.  When playing is stopped, a
+ * worker that is still busy is abandoned: it frees its result and the
+ * prefetch itself when it is done, so quitting never waits for the network.
+ */
+struct prefetch {
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+	int		 running;	/* thread not joined yet */
+	int		 pending;	/* result not picked up yet */
+	int		 ready;		/* track has been fetched */
+	int		 stop;		/* abandon the stream download */
+	int		 finished;	/* worker is done with the prefetch */
+	int		 abandoned;	/* worker frees the prefetch */
+	int		 continuous;	/* play similar mixes after this one */
+	int		 similar;	/* fetching the next mix */
+	int		 mixid;
+	char		*playtoken;
+	struct mix	*mix;		/* the next mix, if similar */
+	struct track	*track;
+};
+
+/*
+ * A track that was streamed, being saved to the cache in the background.
+ */
+struct store {
+	int	 id;
+	char	*url;
+};
+
+/*
+ * What is playing, for the status command of the daemon.
+ */
+struct nowplaying {
+	pthread_mutex_t	 lock;
+	char		 mix[256];
+	char		 track[256];
+	int		 status;
+	int		 position;
+	int		 duration;
+	char		*url;		/* asked to be played next */
+};
+
 extern char	*__progname;
 static struct	termios termios;
+static int	termiosflag;	/* termios has to be restored */
 static int	quitflag;
+static int	sigpipe[2];	/* wakes getkey on SIGINT, in any thread */
+static int	stopflag;	/* stop playing, but keep running */
+static int	daemonflag;
+static int	vflag;
+static struct	nowplaying now = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.status = STOPPED
+};
+static struct	timespec stoptime;	/* when the previous track ended */
+static struct	timespec playstart;	/* when play was asked for, until
+					   the first track plays */
+static pthread_mutex_t	detachedlock = PTHREAD_MUTEX_INITIALIZER;
+static int	detached;	/* workers left running in the background */
 
-static int	nbgetchar(void);	/* non-blocking getchar */
+static void	command(char *, FILE *);
+static double	elapsed(const struct timespec *);
+static void	*fetchmix(void *);
+static void	*fetchtoken(void *);
+static int	getkey(int);
+static int	idle(void);
+static int	nextwait(int, int, const struct timespec *);
 static void	play(const char *, int);
-static void	playmix(int, const char *);
-static int	playtrack(int, struct track *, const char *);
-static void	printshortmix(struct mix *);
-static void	printtime(void);
+static void	playdaemon(const char *, int);
+static int	playmix(int, struct track *, const char *, int,
+		    struct mix **, struct track **);
+static void	playmixes(struct mix *, char **, int *, int);
+static int	playtrack(int, struct track *, const char *,
+		    struct prefetch *);
+static void	prefetch_end(struct prefetch *);
+static void	prefetch_free(struct prefetch *);
+static struct	track *prefetch_get(struct prefetch *);
+static struct	prefetch *prefetch_new(int);
+static void	*prefetch_run(void *);
+static void	prefetch_start(struct prefetch *, int, const char *, int);
+static int	prefetch_stopped(void *);
+static void	printmix(FILE *, struct mix *);
+static void	printnow(FILE *);
+static void	printpage(int, struct mix **, size_t, void *);
+static void	printquery(size_t, struct mix *, void *);
+static void	printshortmix(FILE *, struct mix *);
+static void	printstats(const struct timespec *);
+static void	printtime(int, int, int);
+static void	query(char **, int, int, int);
+static char	**readurls(int *);
 static void	resettermios(void);
-static void	search(const char *, int, int);
+static void	search(const char *, int, int, int, int);
+static int	sendcommand(const char *, int, char **);
 static int	settermios(void);
 static void	signalhandler(int);
+static void	*statsdump(void *);
+static void	store_start(const struct track *);
+static void	*store_run(void *);
+static int	store_stopped(void *);
 static void	usage(void);
 
 /*
- * Non-blocking getchar
- * Returns the character if one is available, else it returns -1.
+ * Carries out a command sent to the daemon and writes the reply to fp.
+ * Runs on the thread that serves the client.
  */
-static int
-nbgetchar(void)
+static void
+command(char *line, FILE *fp)
 {
-	struct timeval tv = { .tv_sec = 0, .tv_usec = 0 };
-	fd_set fds;
-	int nr;
+	struct mix *mix, **mixes;
+	char *arg;
+	size_t i, len;
+	int playing;
+
+	if ((arg = strchr(line, ' ')) != NULL) {
+		*arg++ = '\0';
+		arg += strspn(arg, " ");
+		if (*arg == '\0')
+			arg = NULL;
+	}
+	pthread_mutex_lock(&now.lock);
+	playing = now.status != STOPPED;
+	pthread_mutex_unlock(&now.lock);
 
-	FD_ZERO(&fds);
-	FD_SET(STDIN_FILENO, &fds);
-	select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv);
-	if (FD_ISSET(STDIN_FILENO, &fds))
-		nr = getchar();
+	if (strcmp(line, "play") == 0 && arg != NULL) {
+		pthread_mutex_lock(&now.lock);
+		free(now.url);
+		if ((now.url = strdup(arg)) == NULL)
+			err(1, NULL);
+		pthread_mutex_unlock(&now.lock);
+		control_postkey(KEYPLAY);
+	} else if (strcmp(line, "status") == 0) {
+		printnow(fp);
+		return;
+	} else if (strcmp(line, "query") == 0 && arg != NULL) {
+		if ((mix = mix_getbyurl(arg)) == NULL) {
+			fprintf(fp, "error: Mix not found.\n");
+			return;
+		}
+		printmix(fp, mix);
+		mix_free(mix);
+		return;
+	} else if (strcmp(line, "search") == 0 && arg != NULL) {
+		if ((mixes = mixset_searchbysmartid(arg, 0, 0, &len)) == NULL) {
+			fprintf(fp, "error: Search returned no results.\n");
+			return;
+		}
+		for (i = 0; i < len; ++i)
+			if (mixes[i] != NULL)
+				printshortmix(fp, mixes[i]);
+		mixset_free(&mixes, len);
+		return;
+	} else if (strcmp(line, "quit") == 0)
+		control_postkey('q');
+	else if (strcmp(line, "skip") != 0 && strcmp(line, "next") != 0 &&
+	    strcmp(line, "pause") != 0 && strcmp(line, "stop") != 0) {
+		fprintf(fp, "error: unknown command\n");
+		return;
+	} else if (!playing) {
+		fprintf(fp, "error: not playing\n");
+		return;
+	} else if (strcmp(line, "skip") == 0)
+		control_postkey('\n');
+	else if (strcmp(line, "next") == 0)
+		control_postkey('>');
+	else if (strcmp(line, "pause") == 0)
+		control_postkey('p');
 	else
-		nr = -1;
-	return nr;
+		control_postkey(KEYSTOP);
+	fprintf(fp, "ok\n");
+}
+
+/*
+ * Returns the number of milliseconds passed since ts.
+ */
+static double
+elapsed(const struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - ts->tv_sec) * 1000.0 +
+	    (now.tv_nsec - ts->tv_nsec) / 1000000.0;
+}
+
+/*
+ * Looks up the mix at url for play.
+ */
+static void *
+fetchmix(void *url)
+{
+	return mix_getbyurl(url);
+}
+
+/*
+ * Gets a play token for play, preferably the one kept from an earlier run,
+ * in which case *reused is set.
+ */
+static void *
+fetchtoken(void *reused)
+{
+	char *playtoken;
+
+	if ((playtoken = state_getplaytoken()) != NULL) {
+		*(int *)reused = 1;
+		return playtoken;
+	}
+	if ((playtoken = getplaytoken()) != NULL)
+		state_setplaytoken(playtoken);
+	return playtoken;
+}
+
+/*
+ * Waits up to timeout milliseconds for a key press, or a key posted by the
+ * control socket, and returns the key, or -1 if none was pressed.  A
+ * negative timeout waits until a key is pressed or SIGINT arrives.
+ */
+static int
+getkey(int timeout)
+{
+	static int eofflag;
+	struct pollfd pfd[3] = {
+		{ .fd = STDIN_FILENO, .events = POLLIN },
+		{ .fd = -1, .events = POLLIN },
+		{ .fd = -1, .events = POLLIN }
+	};
+	unsigned char c;
+
+	/* the daemon is only told what to do through its socket */
+	if (eofflag || daemonflag)
+		pfd[0].fd = -1;	/* nothing left to read, only sleep */
+	pfd[1].fd = control_fd();
+	pfd[2].fd = sigpipe[0];
+	/* the byte of SIGINT is left in the pipe, we are quitting anyway */
+	if (poll(pfd, 3, timeout) <= 0 || pfd[2].revents & POLLIN)
+		return -1;
+	if (pfd[1].revents & POLLIN)
+		return control_getkey();
+	if (read(STDIN_FILENO, &c, 1) != 1) {
+		eofflag = 1;
+		return -1;
+	}
+	return c;
+}
+
+/*
+ * Returns 1 if no worker left running in the background is still busy,
+ * 0 otherwise.
+ */
+static int
+idle(void)
+{
+	int n;
+
+	pthread_mutex_lock(&detachedlock);
+	n = detached;
+	pthread_mutex_unlock(&detachedlock);
+	return n == 0;
+}
+
+/*
+ * Returns how long playtrack may wait for input: until the position is due
+ * to tick over to the next second, or for as long as it takes while paused.
+ * Close to the end of the track the wait is kept short, so the next track
+ * is started without delay.
+ */
+static int
+nextwait(int status, int position, const struct timespec *tick)
+{
+	int duration, ms;
+
+	if (status == PAUSED)
+		return -1;
+	duration = player_getduration();
+	if (duration <= 0 || position >= duration - 1)
+		return POLLMIN;
+	ms = 1000 - (int)elapsed(tick);
+	return ms < POLLMIN ? POLLMIN : ms;
 }
 
 static void
 play(const char *url, int cflag)
 {
-	struct mix *mix = NULL;
+	struct mix *mix;
 	char *playtoken;
-	int mixid;
+	pthread_t mt, pt;
+	void *p;
+	int reused = 0;
 
+	clock_gettime(CLOCK_MONOTONIC, &playstart);
+	/* the play token, the mix and the audio device are independent */
+	if (pthread_create(&pt, NULL, fetchtoken, &reused) != 0 ||
+	    pthread_create(&mt, NULL, fetchmix, (void *)url) != 0)
+		errx(1, "pthread_create failed");
 	settermios();
 	player_init();
+	journal_init();
+	pthread_join(pt, &p);
+	playtoken = p;
+	pthread_join(mt, &p);
+	mix = p;
 
-	playtoken = getplaytoken();
 	if (playtoken == NULL) {
 		printf("Could not get a playtoken\n");
 		goto end;
 	}
-
-	mix = mix_getbyurl(url);
 	if (mix == NULL) {
 		printf("Mix not found.\n");
 		goto end;
 	}
-start:
-	printf("%s by %s\n", mix->name, mix->user);
-	playmix(mix->id, playtoken);
-
-	if (cflag && !quitflag) {
-		mixid = mix->id;
-		mix_free(mix);
-		mix = mix_getbysimilar(mixid, playtoken);
-		if (mix == NULL)
-			printf("Could not get the next mix.\n");
-		else
-			goto start;
-	}
+	playmixes(mix, &playtoken, &reused, cflag);
+	mix = NULL;
  end:
 	mix_free(mix);
 	free(playtoken);
+	journal_exit();
 	player_exit();
 	resettermios();
 }
 
+/*
+ * Runs the player as a daemon that is controlled over the socket at path.
+ * The player, the play token and the connections stay warm between mixes.
+ */
 static void
-playmix(int mixid, const char *playtoken)
+playdaemon(const char *path, int cflag)
 {
-	struct track *track;
-	int cmd, i;
+	struct mix *mix;
+	char *playtoken = NULL, *url;
+	int ch, reused = 0;
 
-	track = track_getfirst(mixid, playtoken);
-	if (track == NULL) {
-		printf("Could not load the playlist.\n");
-		return;
+	/* the output is usually a log */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	player_init();
+	journal_init();
+	if (control_init(path, command) == -1)
+		err(1, "%s", path);
+	while (!quitflag && (ch = getkey(-1)) != 'q') {
+		if (ch != KEYPLAY)
+			continue;
+		/* a play command while playing replaces the mix */
+		for (;;) {
+			pthread_mutex_lock(&now.lock);
+			url = now.url;
+			now.url = NULL;
+			pthread_mutex_unlock(&now.lock);
+			if (url == NULL || quitflag)
+				break;
+			clock_gettime(CLOCK_MONOTONIC, &playstart);
+			stoptime.tv_sec = 0;	/* idle, not a track gap */
+			stopflag = 0;
+			if (playtoken == NULL &&
+			    (playtoken = fetchtoken(&reused)) == NULL)
+				printf("Could not get a playtoken\n");
+			else if ((mix = mix_getbyurl(url)) == NULL)
+				printf("Mix not found.\n");
+			else
+				playmixes(mix, &playtoken, &reused, cflag);
+			free(url);
+		}
 	}
+	control_exit();
+	free(now.url);
+	free(playtoken);
+	journal_exit();
+	player_exit();
+}
+
+/*
+ * Plays the tracks of a mix, starting with track if it has already been
+ * fetched.  With cflag, the similar mix to play next and its first track
+ * are looked up while the last track plays and returned in next and
+ * nexttrack.  Returns -1 if the playlist could not be loaded, 0 otherwise.
+ */
+static int
+playmix(int mixid, struct track *track, const char *playtoken, int cflag,
+    struct mix **next, struct track **nexttrack)
+{
+	struct prefetch *pf;
+	int cmd, i;
+
+	*next = NULL;
+	*nexttrack = NULL;
+	if (track == NULL && (track = track_getfirst(mixid, playtoken)) == NULL)
+		return -1;
+	pf = prefetch_new(cflag);
 	for (i = 1; track != NULL; ++i) {
 		printf("%02d. %s - %s\n", i, track->performer, track->name);
-		cmd = playtrack(mixid, track, playtoken);
+		pthread_mutex_lock(&now.lock);
+		snprintf(now.track, sizeof(now.track), "%02d. %s - %s", i,
+		    track->performer, track->name);
+		pthread_mutex_unlock(&now.lock);
+		cmd = playtrack(mixid, track, playtoken, pf);
+		clock_gettime(CLOCK_MONOTONIC, &stoptime);
 		track_free(track);
-		if (quitflag)
+		if (quitflag || stopflag || cmd == SKIPMIX || pf->similar)
 			break;
-		if (cmd == NEXT)
+		/*
+		 * Once the next track is prefetched the server has already
+		 * moved past the current one, so a skip must not skip again.
+		 */
+		if (pf->pending)
+			track = prefetch_get(pf);
+		else if (cmd == NEXT)
 			track = track_getnext(mixid, playtoken);
 		else if (cmd == SKIP)
 			track = track_getskip(mixid, playtoken);
-		else if (cmd == SKIPMIX)
-			break;
 	}
+	if (pf->similar && !quitflag && !stopflag) {
+		*nexttrack = prefetch_get(pf);
+		/* still pending if playing was stopped while waiting */
+		if (!pf->pending) {
+			*next = pf->mix;
+			pf->mix = NULL;
+		}
+	}
+	prefetch_end(pf);
+	return 0;
+}
+
+/*
+ * Plays mix and, with cflag, similar mixes after it, until stopped.  The
+ * play token is replaced if one that was reused turns out to have expired.
+ * Frees mix.
+ */
+static void
+playmixes(struct mix *mix, char **playtoken, int *reused, int cflag)
+{
+	struct mix *next;
+	struct track *track = NULL;
+	int mixid, n;
+
+start:
+	printf("%s by %s\n", mix->name, mix->user);
+	pthread_mutex_lock(&now.lock);
+	snprintf(now.mix, sizeof(now.mix), "%s by %s", mix->name, mix->user);
+	pthread_mutex_unlock(&now.lock);
+	n = playmix(mix->id, track, *playtoken, cflag, &next, &track);
+	if (n == -1 && *reused) {
+		/* the play token of an earlier run may have expired */
+		free(*playtoken);
+		if ((*playtoken = getplaytoken()) == NULL) {
+			printf("Could not get a playtoken\n");
+			goto end;
+		}
+		state_setplaytoken(*playtoken);
+		n = playmix(mix->id, NULL, *playtoken, cflag, &next, &track);
+	}
+	if (n == -1)
+		printf("Could not load the playlist.\n");
+	*reused = 0;
+
+	if (cflag && !quitflag && !stopflag) {
+		mixid = mix->id;
+		mix_free(mix);
+		/* usually found while the last track was playing */
+		if ((mix = next) == NULL)
+			mix = mix_getbysimilar(mixid, *playtoken);
+		if (mix == NULL)
+			printf("Could not get the next mix.\n");
+		else
+			goto start;
+	}
+end:
+	mix_free(mix);
+	track_free(track);
+	pthread_mutex_lock(&now.lock);
+	now.status = STOPPED;
+	now.mix[0] = now.track[0] = '\0';
+	pthread_mutex_unlock(&now.lock);
 }
 
 /*
@@ -144,19 +537,61 @@ playmix(int mixid, const char *playtoken)
  * or it can return SKIP or SKIPMIX.
  */
 static int
-playtrack(int mixid, struct track *track, const char *playtoken)
+playtrack(int mixid, struct track *track, const char *playtoken,
+    struct prefetch *pf)
 {
-	struct timespec tm = { .tv_sec = 0, .tv_nsec = 50000000 };
+	struct timespec tick;	/* when the position last changed */
+	char *path;
 	int ch, cmd = NEXT, reportflag = 0;
+	int position, status, lastposition = -1, laststatus = -1;
+	double ms;
 
-	player_play(track->url);
+	path = cache_lookup(track->id);
+	player_play(path != NULL ? path : track->url);
+	if (path == NULL)
+		store_start(track);
+	free(path);
+	if (stoptime.tv_sec != 0) {
+		ms = elapsed(&stoptime);
+		stats_gap(ms);
+		if (vflag)
+			fprintf(stderr, "track gap: %.0f ms\n", ms);
+	}
 	while (player_getstatus() != STOPPED) {
 		if (quitflag) {
 			player_stop();
 			goto end;
 		}
-		printtime();
-		ch = nbgetchar();
+		/* only redraw the clock when it changed */
+		status = player_getstatus();
+		position = player_getposition();
+		if (status == PLAYING && playstart.tv_sec != 0) {
+			ms = elapsed(&playstart);
+			stats_firstaudio(ms);
+			if (vflag)
+				fprintf(stderr, "time to first audio: %.0f ms\n",
+				    ms);
+			playstart.tv_sec = 0;
+		}
+		if (status != laststatus || position != lastposition) {
+			pthread_mutex_lock(&now.lock);
+			now.status = status;
+			now.position = position;
+			now.duration = player_getduration();
+			pthread_mutex_unlock(&now.lock);
+			if (!daemonflag)
+				printtime(status, position, now.duration);
+			clock_gettime(CLOCK_MONOTONIC, &tick);
+			laststatus = status;
+			lastposition = position;
+		}
+		if (!reportflag && position > REPORTTIME) {
+			journal_report(track->id, mixid, playtoken);
+			reportflag = 1;
+			prefetch_start(pf, mixid, playtoken,
+			    track->lastflag);
+		}
+		ch = getkey(nextwait(status, position, &tick));
 		switch (ch) {
 		case 'q':
 			printf("Quitting...\n");
@@ -183,71 +618,383 @@ playtrack(int mixid, struct track *track, const char *playtoken)
 		case ' ':
 			player_togglepause();
 			break;
+		case KEYPLAY:
+		case KEYSTOP:
+			printf("Stopping...\n");
+			player_stop();
+			stopflag = 1;
+			goto end;
 		default:
 			break;
 		}
-		if (!reportflag && player_getposition() > 30) {
-			report(track->id, mixid, playtoken);
-			reportflag = 1;
-		}
-		nanosleep(&tm, NULL);
 	}
 end:
 	return cmd;
 }
 
+/*
+ * Discards an unused result and frees pf.  A worker that is still busy is
+ * told to stop and left to free pf itself.
+ */
+static void
+prefetch_end(struct prefetch *pf)
+{
+	pthread_t thread = pf->thread;
+	int busy = 0, running = pf->running;
+
+	pthread_mutex_lock(&pf->lock);
+	pf->stop = 1;
+	if (running && !pf->finished) {
+		pthread_mutex_lock(&detachedlock);
+		detached++;
+		pthread_mutex_unlock(&detachedlock);
+		busy = pf->abandoned = 1;
+	}
+	pthread_mutex_unlock(&pf->lock);
+	/* pf may be gone already once the worker knows it is abandoned */
+	if (busy)
+		pthread_detach(thread);
+	else {
+		if (running)
+			pthread_join(thread, NULL);
+		prefetch_free(pf);
+	}
+}
+
+static void
+prefetch_free(struct prefetch *pf)
+{
+	track_free(pf->track);
+	mix_free(pf->mix);
+	free(pf->playtoken);
+	pthread_cond_destroy(&pf->cond);
+	pthread_mutex_destroy(&pf->lock);
+	free(pf);
+}
+
+/*
+ * Waits for the prefetched track and returns it.  Returns NULL when no
+ * prefetch is pending or the mix has no next track, and, leaving the
+ * prefetch pending, when playing is stopped while waiting.  A stream
+ * download that has not finished yet is abandoned, the track will be
+ * streamed.  The next mix, if the worker looked one up, is left in pf->mix.
+ */
+static struct track *
+prefetch_get(struct prefetch *pf)
+{
+	struct timespec ts;
+	struct track *track = NULL;
+
+	if (!pf->pending)
+		return NULL;
+	pthread_mutex_lock(&pf->lock);
+	/* SIGINT does not wake the wait, so look at the flags now and then */
+	while (!pf->ready && !quitflag && !stopflag) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		if ((ts.tv_nsec += 100000000) >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&pf->cond, &pf->lock, &ts);
+	}
+	if (pf->ready) {
+		track = pf->track;
+		pf->track = NULL;
+		pf->stop = 1;
+		pf->pending = 0;
+	}
+	pthread_mutex_unlock(&pf->lock);
+	return track;
+}
+
+static struct prefetch *
+prefetch_new(int continuous)
+{
+	struct prefetch *pf;
+
+	if ((pf = calloc(1, sizeof(struct prefetch))) == NULL)
+		err(1, NULL);
+	pf->continuous = continuous;
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->cond, NULL);
+	return pf;
+}
+
+static void *
+prefetch_run(void *arg)
+{
+	struct prefetch *pf = arg;
+	struct mix *mix = NULL;
+	struct track *track = NULL;
+	char *url = NULL;
+	int id = 0, orphan;
+
+	if (!pf->similar)
+		track = track_getnext(pf->mixid, pf->playtoken);
+	else if ((mix = mix_getbysimilar(pf->mixid, pf->playtoken)) != NULL)
+		track = track_getfirst(mix->id, pf->playtoken);
+	/* the track may be freed once published, keep what we need */
+	if (track != NULL && track->url != NULL) {
+		id = track->id;
+		if ((url = strdup(track->url)) == NULL)
+			err(1, NULL);
+	}
+
+	pthread_mutex_lock(&pf->lock);
+	pf->mix = mix;
+	pf->track = track;
+	pf->ready = 1;
+	pthread_cond_signal(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+
+	if (url != NULL) {
+		cache_store(id, url, prefetch_stopped, pf);
+		free(url);
+	}
+
+	pthread_mutex_lock(&pf->lock);
+	pf->finished = 1;
+	orphan = pf->abandoned;
+	pthread_mutex_unlock(&pf->lock);
+	if (orphan) {
+		prefetch_free(pf);
+		pthread_mutex_lock(&detachedlock);
+		detached--;
+		pthread_mutex_unlock(&detachedlock);
+	}
+	return NULL;
+}
+
+/*
+ * Starts fetching what comes after the track that is playing.  last is set
+ * if that is the last track of the mix.
+ */
+static void
+prefetch_start(struct prefetch *pf, int mixid, const char *playtoken,
+    int last)
+{
+	int n;
+
+	/* without continuous play, nothing comes after the last track */
+	if (pf->pending || (last && !pf->continuous))
+		return;
+	if (pf->running) {
+		pthread_join(pf->thread, NULL);
+		pf->running = 0;
+	}
+	free(pf->playtoken);
+	/* the worker may outlive the play token of the caller */
+	if ((pf->playtoken = strdup(playtoken)) == NULL)
+		err(1, NULL);
+	pf->similar = last;
+	pf->mixid = mixid;
+	pf->track = NULL;
+	pf->ready = 0;
+	pf->stop = 0;
+	pf->finished = 0;
+	n = pthread_create(&pf->thread, NULL, prefetch_run, pf);
+	if (n != 0) {
+		/* fall back to fetching after the track has ended */
+		warnx("pthread_create: %s", strerror(n));
+		return;
+	}
+	pf->running = 1;
+	pf->pending = 1;
+}
+
+static int
+prefetch_stopped(void *arg)
+{
+	struct prefetch *pf = arg;
+	int stop;
+
+	pthread_mutex_lock(&pf->lock);
+	stop = pf->stop;
+	pthread_mutex_unlock(&pf->lock);
+	return stop;
+}
+
+static void
+printmix(FILE *fp, struct mix *mix)
+{
+	fprintf(fp, "Mix name:\t%s ", mix->name);
+	fprintf(fp, "(id: %d)\n", mix->id);
+	fprintf(fp, "Created by:\t%s ", mix->user);
+	fprintf(fp, "(id: %d)\n", mix->userid);
+	fprintf(fp, "Description:\n%s\n", mix->description);
+	fprintf(fp, "Tags:\t%s\n", mix->tags);
+	if (mix->certification)
+		fprintf(fp, "Certification:\t%s\n", mix->certification);
+	fprintf(fp, "Plays: %d\t likes: %d\t%d min (%d tracks)\n",
+	    mix->playscount, mix->likescount, mix->duration / 60,
+	    mix->trackscount);
+}
+
+/*
+ * Prints what the daemon is playing.
+ */
+static void
+printnow(FILE *fp)
+{
+	pthread_mutex_lock(&now.lock);
+	fprintf(fp, "status: %s\n", now.status == PLAYING ? "playing" :
+	    now.status == PAUSED ? "paused" : "stopped");
+	if (now.status != STOPPED) {
+		fprintf(fp, "mix: %s\n", now.mix);
+		fprintf(fp, "track: %s\n", now.track);
+		fprintf(fp, "position: %02d:%02d/%02d:%02d\n",
+		    now.position / 60, now.position % 60,
+		    now.duration / 60, now.duration % 60);
+	}
+	pthread_mutex_unlock(&now.lock);
+}
+
+/*
+ * Prints a page of search results as soon as it arrives.
+ */
 static void
-printshortmix(struct mix *mix)
+printpage(int page, struct mix **mix, size_t len, void *arg)
 {
-	printf("%s\n", mix->url + 1);	/* skip first character */
-	printf("\t%s\n", mix->tags);
+	size_t i;
+	int *found = arg;
+
+	if (mix == NULL) {
+		printf("Page %d could not be loaded.\n", page);
+		return;
+	}
+	for (i = 0; i < len; ++i)
+		if (mix[i] != NULL)
+			printshortmix(stdout, mix[i]);
+	fflush(stdout);
+	*found += len > 0;
+	mixset_free(&mix, len);
+}
+
+/*
+ * Prints the result of one mix of a batch query.
+ */
+static void
+printquery(size_t i, struct mix *mix, void *arg)
+{
+	char **urls = arg;
+
+	if (mix == NULL)
+		printf("%s: Mix not found.\n\n", urls[i]);
+	else {
+		printf("URL:\t\t%s\n", urls[i]);
+		printmix(stdout, mix);
+		printf("\n");
+		mix_free(mix);
+	}
+	fflush(stdout);
+}
+
+static void
+printshortmix(FILE *fp, struct mix *mix)
+{
+	fprintf(fp, "%s\n", mix->url + 1);	/* skip first character */
+	fprintf(fp, "\t%s\n", mix->tags);
 	if (mix->certification != NULL)
-		printf("\tcert: %s\n", mix->certification);
+		fprintf(fp, "\tcert: %s\n", mix->certification);
 	if (mix->duration < 0) {
-		printf("\tplays: %d\tlikes: %d\t(%d tracks)\n",
+		fprintf(fp, "\tplays: %d\tlikes: %d\t(%d tracks)\n",
 		    mix->playscount, mix->likescount, mix->trackscount);
 	} else {
-		printf("\tplays: %d\t likes: %d\t%d min (%d tracks)\n",
+		fprintf(fp, "\tplays: %d\t likes: %d\t%d min (%d tracks)\n",
 		    mix->playscount, mix->likescount, mix->duration / 60,
 		    mix->trackscount);
 	}
 }
 
+/*
+ * Displays the info of the mixes at urls.  More than one mix is looked up
+ * with up to jobs requests at a time, and each mix is printed as soon as it
+ * arrives, or in the order of urls if ordered is set.
+ */
 static void
-query(const char *url)
+query(char **urls, int n, int jobs, int ordered)
 {
 	struct mix *mix;
 
-	mix = mix_getbyurl(url);
+	if (n > 1) {
+		mix_getbyurls((const char **)urls, (size_t)n, jobs, ordered,
+		    printquery, urls);
+		return;
+	}
+
+	mix = mix_getbyurl(urls[0]);
 	if (mix == NULL) {
 		printf("Mix not found.\n");
-		goto end;
+		return;
 	}
-	printf("Mix name:\t%s ", mix->name);
-	printf("(id: %d)\n", mix->id);
-	printf("Created by:\t%s ", mix->user);
-	printf("(id: %d)\n", mix->userid);
-	printf("Description:\n%s\n", mix->description);
-	printf("Tags:\t%s\n", mix->tags);
-	if (mix->certification)
-		printf("Certification:\t%s\n", mix->certification);
-	printf("Plays: %d\t likes: %d\t%d min (%d tracks)\n",
-	    mix->playscount, mix->likescount, mix->duration / 60,
-	    mix->trackscount);
-end:
+	printmix(stdout, mix);
 	mix_free(mix);
 }
 
+/*
+ * Reads mix URLs from standard input, one per line.
+ */
+static char **
+readurls(int *n)
+{
+	char **urls = NULL, **tmp, *line = NULL;
+	size_t cap = 0, len, size = 0;
+	ssize_t nr;
+
+	*n = 0;
+	while ((nr = getline(&line, &cap, stdin)) != -1) {
+		len = (size_t)nr;
+		while (len > 0 && (line[len - 1] == '\n' ||
+		    line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		if ((size_t)*n == size) {
+			size = size ? size * 2 : 64;
+			if ((tmp = realloc(urls, size * sizeof(char *))) == NULL)
+				err(1, NULL);
+			urls = tmp;
+		}
+		if ((urls[(*n)++] = strdup(line)) == NULL)
+			err(1, NULL);
+	}
+	free(line);
+	return urls;
+}
+
+/*
+ * Prints what the run cost: the API requests made, the track cache and the
+ * peak memory use.
+ */
 static void
-printtime(void)
+printstats(const struct timespec *start)
 {
-	int duration, position;
+	struct cachestats cs;
+	struct curlstats st;
+	struct rusage ru;
+	double ms;
+
+	ms = elapsed(start);
+	curl_getstats(&st);
+	fprintf(stderr, "requests: %lu sent, %lu failed, %lu retried, "
+	    "%lu from cache, %.0f ms, %llu bytes\n", st.requests, st.failed,
+	    st.retries, st.cached, st.time * 1000.0, st.bytes);
+	if (ms > 0)
+		fprintf(stderr, "run time: %.0f ms, %.1f requests/s\n", ms,
+		    (st.requests + st.cached) * 1000.0 / ms);
+	cache_getstats(&cs);
+	fprintf(stderr, "track cache: %lu hits, %lu misses, "
+	    "%lu evictions\n", cs.hits, cs.misses, cs.evictions);
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		fprintf(stderr, "peak RSS: %ld KB\n", ru.ru_maxrss);
+}
 
-	if (player_getstatus() == PAUSED) {
+static void
+printtime(int status, int position, int duration)
+{
+	if (status == PAUSED) {
 		printf("(paused)       \r");
 	} else {
-		duration = player_getduration();
-		position = player_getposition();
 		printf("%02d:%02d/%02d:%02d\r",
 		    position / 60, position % 60,
 		    duration / 60, duration % 60);
@@ -258,15 +1005,29 @@ printtime(void)
 static void
 resettermios(void)
 {
-	tcsetattr(STDIN_FILENO, TCSAFLUSH, &termios);
+	if (termiosflag)
+		tcsetattr(STDIN_FILENO, TCSAFLUSH, &termios);
+	termiosflag = 0;
 }
 
+/*
+ * Searches page p, or when lastp is set the pages p up to lastp.  A
+ * negative lastp searches all pages.  Pages are fetched with up to jobs
+ * requests at a time.
+ */
 static void
-search(const char *smartid, int p, int pp)
+search(const char *smartid, int p, int pp, int lastp, int jobs)
 {
 	struct mix **mix;
 	size_t len;
-	int i;
+	int found = 0, i;
+
+	if (lastp != 0) {
+		if (mixset_searchpages(smartid, p, lastp, pp, jobs, printpage,
+		    &found) == -1 || !found)
+			printf("Search returned no results.\n");
+		return;
+	}
 
 	mix = mixset_searchbysmartid(smartid, p, pp, &len);
 	if (mix == NULL) {
@@ -274,19 +1035,50 @@ search(const char *smartid, int p, int pp)
 		return;
 	}
 	for (i = 0; (size_t) i < len; ++i)
-		printshortmix(mix[i]);
+		printshortmix(stdout, mix[i]);
 	mixset_free(&mix, len);
 }
 
+/*
+ * Sends a command line made of argv to the daemon at path and prints the
+ * reply.  Returns the exit status.
+ */
+static int
+sendcommand(const char *path, int argc, char **argv)
+{
+	char *line;
+	size_t len = 0;
+	int i, n;
+
+	for (i = 0; i < argc; ++i)
+		len += strlen(argv[i]) + 1;
+	if ((line = malloc(len)) == NULL)
+		err(1, NULL);
+	line[0] = '\0';
+	for (i = 0; i < argc; ++i) {
+		if (i > 0)
+			strcat(line, " ");
+		strcat(line, argv[i]);
+	}
+	n = control_send(path, line, stdout);
+	free(line);
+	if (n == -1)
+		err(1, "%s", path);
+	return n;
+}
+
 /*
  * Disables echo and canonical mode, so we can register key hits without
- * them being displayed.
+ * them being displayed.  The terminal is left alone when we run in the
+ * background, as changing it would stop us with SIGTTOU.
  */
 static int
 settermios(void)
 {
 	struct termios buf;
 
+	if (!isatty(STDIN_FILENO) || tcgetpgrp(STDIN_FILENO) != getpgrp())
+		goto error;
 	if (tcgetattr(STDIN_FILENO, &termios))
 		goto error;
 
@@ -296,53 +1088,152 @@ settermios(void)
 
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &buf) < 0)
 		goto error;
+	termiosflag = 1;
 	return 0;
 error:
 	return -1;
 }
 
+/*
+ * The signal may be taken by any thread, so besides setting quitflag the
+ * handler writes to sigpipe to wake the main thread in getkey.
+ */
 static void
 signalhandler(int n)
 {
-	if (n == SIGINT)
+	int saved = errno;
+
+	if (n == SIGINT) {
 		quitflag = 1;
+		/* a full pipe will wake getkey all the same */
+		while (write(sigpipe[1], "", 1) == -1 && errno == EINTR)
+			continue;
+	}
+	errno = saved;
+}
+
+/*
+ * Prints the statistics every time SIGUSR1 arrives.  The signal is blocked
+ * in every thread, so it is only taken here.
+ */
+static void *
+statsdump(void *arg)
+{
+	sigset_t *set = arg;
+	int n;
+
+	for (;;)
+		if (sigwait(set, &n) == 0 && n == SIGUSR1)
+			stats_print(stderr);
+	return NULL;
+}
+
+/*
+ * Saves a track that is being streamed to the cache in the background, so
+ * that it is played from disk the next time.
+ */
+static void
+store_start(const struct track *track)
+{
+	struct store *s;
+	pthread_t thread;
+	int n;
+
+	if (track->url == NULL)
+		return;
+	if ((s = malloc(sizeof(struct store))) == NULL ||
+	    (s->url = strdup(track->url)) == NULL)
+		err(1, NULL);
+	s->id = track->id;
+	pthread_mutex_lock(&detachedlock);
+	detached++;
+	pthread_mutex_unlock(&detachedlock);
+	if ((n = pthread_create(&thread, NULL, store_run, s)) != 0) {
+		warnx("pthread_create: %s", strerror(n));
+		pthread_mutex_lock(&detachedlock);
+		detached--;
+		pthread_mutex_unlock(&detachedlock);
+		free(s->url);
+		free(s);
+		return;
+	}
+	pthread_detach(thread);
+}
+
+static void *
+store_run(void *arg)
+{
+	struct store *s = arg;
+
+	cache_store(s->id, s->url, store_stopped, NULL);
+	free(s->url);
+	free(s);
+	pthread_mutex_lock(&detachedlock);
+	detached--;
+	pthread_mutex_unlock(&detachedlock);
+	return NULL;
+}
+
+static int
+store_stopped(void *arg)
+{
+	(void)arg;
+	return quitflag;
 }
 
 static void
 usage(void)
 {
 	fprintf(stderr, "usage %s:\n"
-	    "\t%s [-P [-c]] URL\t\tPlay\n"
-	    "\t%s -S [-p page_number] [-i items_per_page] SmartID\t\tSearch\n"
-	    "\t%s -Q URL\t\t\tDisplay mix info\n",
-	    __progname, __progname, __progname, __progname);
+	    "\t%s [-P [-c]] [-v] [-w stats_file] URL\tPlay\n"
+	    "\t%s -S [-v] [-w stats_file] [-p page_number]\n"
+	    "\t    [-l last_page | -a] [-i items_per_page] [-j jobs] SmartID\n"
+	    "\t\t\t\t\t\tSearch\n"
+	    "\t%s -Q [-ov] [-w stats_file] [-j jobs] [URL ...]\n"
+	    "\t\t\t\t\t\tDisplay mix info\n"
+	    "\t%s -D [-cv] [-w stats_file] [-s socket]\tRun as a daemon\n"
+	    "\t%s -C [-s socket] command [argument]\tControl the daemon\n",
+	    __progname, __progname, __progname, __progname, __progname,
+	    __progname);
 	exit(1);
 }
 
 int
 main(int argc, char *argv[])
 {
-	int cflag = 0, ch;
+	struct timespec start;
+	pthread_t dumper;
+	sigset_t usr1;
+	int cflag = 0, ch, oflag = 0;
+	char **urls, *statsfile = NULL, *sockpath = NULL, *defpath = NULL;
 	int pp = 0;	/* items per page */
+	int lastp = 0;	/* last page, -1 for all pages */
+	int jobs = JOBS;	/* concurrent requests */
 	int p = 0;	/* page number */
 	enum {
 		PLAY,
 		SEARCH,
-		QUERY
+		QUERY,
+		DAEMON,
+		CONTROL
 	} cmd = PLAY;
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	quitflag = 0;
 	setlocale(LC_ALL, "");
+	if (pipe(sigpipe) == -1 ||
+	    fcntl(sigpipe[1], F_SETFL, O_NONBLOCK) == -1)
+		err(1, "pipe");
 	signal(SIGINT, signalhandler);
 
-	while ((ch = getopt(argc, argv, "PcSp:i:Q")) != -1) {
+	while ((ch = getopt(argc, argv, "PcSp:i:l:aj:QovDCs:w:")) != -1) {
 		switch (ch) {
 		default:
 		case 'P':
 			cmd = PLAY;
 			break;
 		case 'c':
-			if (cmd != PLAY)
+			if (cmd != PLAY && cmd != DAEMON)
 				usage();
 			cflag = 1;
 			break;
@@ -355,15 +1246,63 @@ main(int argc, char *argv[])
 		case 'p':
 			p = atoi(optarg);
 			break;
+		case 'l':
+			lastp = atoi(optarg);
+			break;
+		case 'a':
+			lastp = -1;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
 		case 'Q':
 			cmd = QUERY;
 			break;
+		case 'o':
+			oflag = 1;
+			break;
+		case 'D':
+			cmd = DAEMON;
+			break;
+		case 'C':
+			cmd = CONTROL;
+			break;
+		case 's':
+			sockpath = optarg;
+			break;
+		case 'v':
+			vflag = 1;
+			break;
+		case 'w':
+			statsfile = optarg;
+			break;
 		}
 	}
 	argc -= optind;
 	argv += optind;
 
+	if ((cmd == DAEMON || cmd == CONTROL) && sockpath == NULL &&
+	    (sockpath = defpath = control_path()) == NULL)
+		errx(1, "no directory for the control socket");
+	if (cmd == CONTROL) {
+		if (argc < 1)
+			usage();
+		ch = sendcommand(sockpath, argc, argv);
+		free(defpath);
+		return ch;
+	}
+
+	/* before any thread is started, so that they all block SIGUSR1 */
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+	if (pthread_create(&dumper, NULL, statsdump, &usr1) != 0)
+		errx(1, "pthread_create failed");
+	pthread_detach(dumper);
+
 	curl_init();
+	cache_init();
+	state_init();
 	switch (cmd) {
 	case PLAY:
 		if (argc < 1)
@@ -373,17 +1312,40 @@ main(int argc, char *argv[])
 	case SEARCH:
 		if (argc < 1)
 			usage();
-		search(argv[0], p, pp);
+		search(argv[0], p, pp, lastp, jobs);
 		break;
 	case QUERY:
+		if (argc > 0) {
+			query(argv, argc, jobs, oflag);
+			break;
+		}
+		/* no URLs given, read them from standard input */
+		urls = readurls(&argc);
 		if (argc < 1)
 			usage();
-		query(argv[0]);
+		query(urls, argc, jobs, oflag);
+		while (argc > 0)
+			free(urls[--argc]);
+		free(urls);
+		break;
+	case DAEMON:
+		daemonflag = 1;
+		playdaemon(sockpath, cflag);
+		free(defpath);
 		break;
 	default:
 		usage();
 		/* NOTREACHED */
 	}
-	curl_exit();
+	if (vflag)
+		printstats(&start);
+	if (statsfile != NULL && stats_write(statsfile) == -1)
+		warnx("could not write statistics to %s", statsfile);
+	state_exit();
+	/* a download in the background may still use the cache and curl */
+	if (idle()) {
+		cache_exit();
+		curl_exit();
+	}
 	return 0;
 }
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2015 Johannes Postma <jgmpostma@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * What one run leaves behind for the next one to start faster: the play
+ * token, so that no new one has to be requested, and the addresses of the
+ * API server, so that it can be connected to without a name lookup.
+ *
+ *	8play state 1
+ *	token <time> <playtoken>
+ *	host <time> <name> <port> <address>
+ *
+ * The state file is written under a temporary name and renamed into place
+ * on exit.  Lines that are malformed or older than their time to live are
+ * ignored, as is the whole file if the first line does not match.
+ *
+ * A play token belongs to one listener, so only the instance that holds
+ * the lock file next to the state file reuses it and writes the state
+ * file.  Others get a play token of their own, which is not kept.
+ */
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "curl.h"
+#include "state.h"
+
+#define STATEHEADER	"8play state 1"
+#define TOKENTTL	(24 * 60 * 60)	/* seconds a play token is reused */
+#define HOSTTTL		(60 * 60)	/* seconds an address is pinned */
+
+static char		*dir;
+static char		*playtoken;
+static time_t		 tokentime;	/* when playtoken was handed out */
+static int		 lockfd = -1;	/* held while the token is ours */
+static pthread_mutex_t	 lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void	 load(const char *);
+static int	 save(const char *);
+
+void
+state_init(void)
+{
+	char *path;
+
+	if ((dir = cache_dir("state")) == NULL)
+		return;
+	if ((path = cache_path(dir, "lock")) != NULL) {
+		lockfd = open(path, O_RDWR | O_CREAT, 0600);
+		if (lockfd != -1 && lockf(lockfd, F_TLOCK, 0) == -1) {
+			close(lockfd);
+			lockfd = -1;
+		}
+	}
+	free(path);
+	if ((path = cache_path(dir, "altsvc")) != NULL)
+		curl_setaltsvc(path);
+	free(path);
+	if ((path = cache_path(dir, "state")) != NULL)
+		load(path);
+	free(path);
+}
+
+void
+state_exit(void)
+{
+	char *path = NULL;
+
+	if (dir == NULL)
+		return;
+	if (lockfd != -1 && ((path = cache_path(dir, "state")) == NULL ||
+	    save(path) == -1))
+		warnx("could not save %s/state", dir);
+	free(path);
+	free(playtoken);
+	playtoken = NULL;
+	if (lockfd != -1)
+		close(lockfd);
+	lockfd = -1;
+	free(dir);
+	dir = NULL;
+}
+
+/*
+ * Reads the state left by an earlier run and pins the addresses in it.
+ */
+static void
+load(const char *path)
+{
+	struct curlhost h;
+	FILE *fp;
+	char *line = NULL;
+	size_t cap = 0, len;
+	ssize_t nr;
+	long long t;
+	time_t now;
+	int off;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return;
+	now = time(NULL);
+	if (getline(&line, &cap, fp) == -1 ||
+	    strncmp(line, STATEHEADER "\n", strlen(STATEHEADER) + 1) != 0)
+		goto end;
+	while ((nr = getline(&line, &cap, fp)) != -1) {
+		len = (size_t)nr;
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (lockfd != -1 &&
+		    sscanf(line, "token %lld %n", &t, &off) == 1 && t <= now && now - t < TOKENTTL && line[off] != '\0' &&
+		    strcspn(&line[off], " \t") == len - off) {
+			free(playtoken);
+			if ((playtoken = strdup(&line[off])) == NULL)
+				err(1, NULL);
+			tokentime = (time_t)t;
+		} else if (sscanf(line, "host %lld %255s %ld %45s", &t, h.name,
+		    &h.port, h.addr) == 4 && t <= now && now - t < HOSTTTL) {
+			h.seen = (time_t)t;
+			curl_pinhost(&h);
+		}
+	}
+end:
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Writes the state for the next run to path.  Returns 0 on success and -1
+ * on failure.
+ */
+static int
+save(const char *path)
+{
+	struct curlhost h[MAXHOSTS];
+	FILE *fp;
+	char *tmp;
+	size_t i, n;
+	int fd, ret = -1;
+
+	if ((tmp = cache_path(dir, ".state.XXXXXX")) == NULL ||
+	    (fd = mkstemp(tmp)) == -1)
+		goto end;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		goto end;
+	}
+	fprintf(fp, "%s\n", STATEHEADER);
+	pthread_mutex_lock(&lock);
+	if (playtoken != NULL)
+		fprintf(fp, "token %lld %s\n", (long long)tokentime,
+		    playtoken);
+	pthread_mutex_unlock(&lock);
+	n = curl_gethosts(h, MAXHOSTS);
+	for (i = 0; i < n; ++i)
+		fprintf(fp, "host %lld %s %ld %s\n", (long long)h[i].seen,
+		    h[i].name, h[i].port, h[i].addr);
+	if (fflush(fp) == 0 && fsync(fd) == 0 && !ferror(fp))
+		ret = 0;
+	fclose(fp);
+	if (ret == 0 && rename(tmp, path) == -1)
+		ret = -1;
+	if (ret == -1)
+		unlink(tmp);
+end:
+	free(tmp);
+	return ret;
+}
+
+/*
+ * Returns a copy of the play token of an earlier run, or NULL if there is
+ * none that is recent enough.
+ */
+char *
+state_getplaytoken(void)
+{
+	char *p = NULL;
+
+	pthread_mutex_lock(&lock);
+	if (playtoken != NULL && (p = strdup(playtoken)) == NULL)
+		err(1, NULL);
+	pthread_mutex_unlock(&lock);
+	return p;
+}
+
+/*
+ * Keeps a play token that was just handed out for the next run.
+ */
+void
+state_setplaytoken(const char *p)
+{
+	char *s;
+
+	if ((s = strdup(p)) == NULL)
+		err(1, NULL);
+	pthread_mutex_lock(&lock);
+	free(playtoken);
+	playtoken = s;
+	tokentime = time(NULL);
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2015 Johannes Postma <jgmpostma@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <json.h>
+
+#include "stats.h"
+
+#define NBUCKETS	16	/* below 1 ms up to 16 s, and anything slower */
+#define NENDPOINTS	16
+
+enum phase {
+	NAMELOOKUP,
+	CONNECT,
+	APPCONNECT,
+	STARTTRANSFER,
+	TOTAL,
+	NPHASES
+};
+
+/*
+ * A latency histogram with power of two buckets: bucket i counts the values
+ * below 2^i ms that did not fit in bucket i - 1.  The last bucket takes the
+ * rest.
+ */
+struct histogram {
+	unsigned long	bucket[NBUCKETS];
+	unsigned long	count;
+	double		sum;
+	double		max;
+};
+
+struct endpoint {
+	char			name[32];
+	unsigned long		failed;
+	unsigned long long	bytes;
+	struct histogram	phase[NPHASES];
+};
+
+static const char *phasename[NPHASES] = {
+	"dns", "connect", "tls", "firstbyte", "total"
+};
+
+static struct endpoint	endpoints[NENDPOINTS];
+static size_t		nendpoints;
+static struct histogram	firstaudio;	/* from play to the first track */
+static struct histogram	gaps;		/* between the end of a track and
+					   the start of the next one */
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void		 histogram_add(struct histogram *, double);
+static json_object	*histogram_json(const struct histogram *);
+static void		 histogram_print(FILE *, const char *, const char *,
+			    const struct histogram *);
+static double		 percentile(const struct histogram *, double);
+
+static void
+histogram_add(struct histogram *h, double ms)
+{
+	int i = 0;
+
+	while (i < NBUCKETS - 1 && ms >= (double)(1UL << i))
+		i++;
+	h->bucket[i]++;
+	h->count++;
+	h->sum += ms;
+	if (ms > h->max)
+		h->max = ms;
+}
+
+static json_object *
+histogram_json(const struct histogram *h)
+{
+	json_object *o, *b;
+	int i;
+
+	o = json_object_new_object();
+	b = json_object_new_array();
+	for (i = 0; i < NBUCKETS; ++i)
+		json_object_array_add(b, json_object_new_int64(h->bucket[i]));
+	json_object_object_add(o, "count", json_object_new_int64(h->count));
+	json_object_object_add(o, "avg_ms", json_object_new_double(
+	    h->count > 0 ? h->sum / h->count : 0));
+	json_object_object_add(o, "p50_ms",
+	    json_object_new_double(percentile(h, 0.5)));
+	json_object_object_add(o, "p90_ms",
+	    json_object_new_double(percentile(h, 0.9)));
+	json_object_object_add(o, "p99_ms",
+	    json_object_new_double(percentile(h, 0.99)));
+	json_object_object_add(o, "max_ms", json_object_new_double(h->max));
+	json_object_object_add(o, "buckets", b);
+	return o;
+}
+
+static void
+histogram_print(FILE *fp, const char *name, const char *phase,
+    const struct histogram *h)
+{
+	if (h->count == 0)
+		return;
+	fprintf(fp, "%-16s %-10s %6lu %8.1f %8.1f %8.1f %8.1f %8.1f\n", name,
+	    phase, h->count, h->sum / h->count, percentile(h, 0.5),
+	    percentile(h, 0.9), percentile(h, 0.99), h->max);
+}
+
+/*
+ * Estimates the q-th quantile as the upper bound of the bucket it falls in,
+ * which is at most 2 times too high.
+ */
+static double
+percentile(const struct histogram *h, double q)
+{
+	unsigned long n = 0;
+	double bound;
+	int i;
+
+	for (i = 0; i < NBUCKETS - 1; ++i) {
+		n += h->bucket[i];
+		if (n >= q * h->count) {
+			bound = (double)(1UL << i);
+			return bound < h->max ? bound : h->max;
+		}
+	}
+	return h->max;
+}
+
+/*
+ * Records how long it took from starting to play to hearing the first
+ * track.
+ */
+void
+stats_firstaudio(double ms)
+{
+	pthread_mutex_lock(&lock);
+	histogram_add(&firstaudio, ms);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Records the silence between two tracks.
+ */
+void
+stats_gap(double ms)
+{
+	pthread_mutex_lock(&lock);
+	histogram_add(&gaps, ms);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Prints a table of all statistics so far.
+ */
+void
+stats_print(FILE *fp)
+{
+	const struct endpoint *e;
+	size_t i;
+	int j;
+
+	pthread_mutex_lock(&lock);
+	fprintf(fp, "%-16s %-10s %6s %8s %8s %8s %8s %8s\n", "endpoint",
+	    "phase", "count", "avg ms", "p50", "p90", "p99", "max");
+	for (i = 0; i < nendpoints; ++i) {
+		e = &endpoints[i];
+		for (j = 0; j < NPHASES; ++j)
+			histogram_print(fp, e->name, phasename[j],
+			    &e->phase[j]);
+		fprintf(fp, "%-16s %lu failed, %llu bytes\n", e->name,
+		    e->failed, e->bytes);
+	}
+	histogram_print(fp, "playback", "firstaudio", &firstaudio);
+	histogram_print(fp, "playback", "gap", &gaps);
+	pthread_mutex_unlock(&lock);
+	fflush(fp);
+}
+
+/*
+ * Records the phases of a finished request to endpoint.  Endpoints beyond
+ * the first NENDPOINTS are not recorded.
+ */
+void
+stats_request(const char *endpoint, const struct timing *t)
+{
+	struct endpoint *e;
+	size_t i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < nendpoints; ++i)
+		if (strcmp(endpoints[i].name, endpoint) == 0)
+			break;
+	if (i == nendpoints) {
+		if (nendpoints == NENDPOINTS)
+			goto end;
+		snprintf(endpoints[i].name, sizeof(endpoints[i].name), "%s",
+		    endpoint);
+		nendpoints++;
+	}
+	e = &endpoints[i];
+	if (t->failed)
+		e->failed++;
+	e->bytes += t->bytes;
+	histogram_add(&e->phase[NAMELOOKUP], t->namelookup * 1000.0);
+	histogram_add(&e->phase[CONNECT], t->connect * 1000.0);
+	histogram_add(&e->phase[APPCONNECT], t->appconnect * 1000.0);
+	histogram_add(&e->phase[STARTTRANSFER], t->starttransfer * 1000.0);
+	histogram_add(&e->phase[TOTAL], t->total * 1000.0);
+end:
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Writes all statistics so far to path as JSON.  Returns 0 on success and
+ * -1 on failure.
+ */
+int
+stats_write(const char *path)
+{
+	const struct endpoint *e;
+	json_object *root, *all, *o;
+	size_t i;
+	int j, ret;
+
+	root = json_object_new_object();
+	all = json_object_new_object();
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < nendpoints; ++i) {
+		e = &endpoints[i];
+		o = json_object_new_object();
+		json_object_object_add(o, "requests",
+		    json_object_new_int64(e->phase[TOTAL].count));
+		json_object_object_add(o, "failed",
+		    json_object_new_int64(e->failed));
+		json_object_object_add(o, "bytes",
+		    json_object_new_int64(e->bytes));
+		for (j = 0; j < NPHASES; ++j)
+			json_object_object_add(o, phasename[j],
+			    histogram_json(&e->phase[j]));
+		json_object_object_add(all, e->name, o);
+	}
+	o = json_object_new_object();
+	json_object_object_add(o, "firstaudio", histogram_json(&firstaudio));
+	json_object_object_add(o, "gap", histogram_json(&gaps));
+	pthread_mutex_unlock(&lock);
+	json_object_object_add(root, "endpoints", all);
+	json_object_object_add(root, "playback", o);
+
+	ret = json_object_to_file_ext(path, root, JSON_C_TO_STRING_PRETTY);
+	json_object_put(root);
+	return ret == 0 ? 0 : -1;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2015 Johannes Postma <jgmpostma@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+/* what a finished request cost, in seconds since it started */
+struct timing {
+	double			namelookup;
+	double			connect;
+	double			appconnect;	/* TLS handshake done */
+	double			starttransfer;	/* first byte received */
+	double			total;
+	unsigned long long	bytes;		/* received */
+	int			failed;
+};
+
+__BEGIN_DECLS
+
+void	stats_firstaudio(double ms);
+void	stats_gap(double ms);
+void	stats_print(FILE *fp);
+void	stats_request(const char *endpoint, const struct timing *t);
+int	stats_write(const char *path);
+
+__END_DECLS
+
+#endif	/* STATS_H */